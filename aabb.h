@@ -17,6 +17,7 @@ public:
     point3 max() const { return maximum; }
 
     bool hit(const ray &r, double t_min, double t_max) const {
+        TRACERGEN_COUNT(stat_box_tests);
         for (int a = 0; a < 3; a++) {
             auto invD = 1.0f / r.direction()[a];
             auto t0 = (min()[a] - r.origin()[a]) * invD;
@@ -12,6 +12,16 @@ public:
 
     inline virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    inline virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    inline virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    inline virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
+    inline virtual double pdf_value(const point3 &o, const vec3 &v) const override;
+
+    inline virtual vec3 random(const point3 &o, sampler &rng) const override;
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Z
         // dimension a small amount.
@@ -34,6 +44,16 @@ public:
 
     inline virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    inline virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    inline virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    inline virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
+    inline virtual double pdf_value(const point3 &o, const vec3 &v) const override;
+
+    inline virtual vec3 random(const point3 &o, sampler &rng) const override;
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Y
         // dimension a small amount.
@@ -56,6 +76,16 @@ public:
 
     inline virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    inline virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    inline virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    inline virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
+    inline virtual double pdf_value(const point3 &o, const vec3 &v) const override;
+
+    inline virtual vec3 random(const point3 &o, sampler &rng) const override;
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the X
         // dimension a small amount.
@@ -69,6 +99,14 @@ public:
 };
 
 bool xy_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool xy_rect::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_rect_tests);
     auto t = (k - r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -76,17 +114,29 @@ bool xy_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) con
     auto y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
     rec.t = t;
+    rec.object = this;
+    return true;
+}
+
+void xy_rect::finish_hit(const ray &r, hit_record &rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.y() - y0) / (y1 - y0);
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 bool xz_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool xz_rect::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_rect_tests);
     auto t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -94,17 +144,29 @@ bool xz_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.object = this;
+    return true;
+}
+
+void xz_rect::finish_hit(const ray &r, hit_record &rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 bool yz_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool yz_rect::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_rect_tests);
     auto t = (k - r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -112,14 +174,102 @@ bool yz_rect::hit(const ray &r, double t_min, double t_max, hit_record &rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.object = this;
+    return true;
+}
+
+void yz_rect::finish_hit(const ray &r, hit_record &rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.y() - y0) / (y1 - y0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+}
+
+bool xy_rect::occluded(const ray &r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_rect_tests);
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
+}
+
+double xy_rect::pdf_value(const point3 &o, const vec3 &v) const {
+    hit_record rec;
+    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+
+    // Uniform area density converted to solid angle: distance^2 / (cosine * area).
+    auto area = (x1 - x0) * (y1 - y0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+vec3 xy_rect::random(const point3 &o, sampler &rng) const {
+    auto random_point = point3(rng.next_double(x0, x1), rng.next_double(y0, y1), k);
+    return random_point - o;
+}
+
+bool xz_rect::occluded(const ray &r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_rect_tests);
+    auto t = (k - r.origin().y()) / r.direction().y();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
+}
+
+double xz_rect::pdf_value(const point3 &o, const vec3 &v) const {
+    hit_record rec;
+    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+
+    // Uniform area density converted to solid angle: distance^2 / (cosine * area).
+    auto area = (x1 - x0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+vec3 xz_rect::random(const point3 &o, sampler &rng) const {
+    auto random_point = point3(rng.next_double(x0, x1), k, rng.next_double(z0, z1));
+    return random_point - o;
+}
+
+bool yz_rect::occluded(const ray &r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_rect_tests);
+    auto t = (k - r.origin().x()) / r.direction().x();
+    if (t < t_min || t > t_max)
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+double yz_rect::pdf_value(const point3 &o, const vec3 &v) const {
+    hit_record rec;
+    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+
+    // Uniform area density converted to solid angle: distance^2 / (cosine * area).
+    auto area = (y1 - y0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+vec3 yz_rect::random(const point3 &o, sampler &rng) const {
+    auto random_point = point3(k, rng.next_double(y0, y1), rng.next_double(z0, z1));
+    return random_point - o;
 }
 
 #endif //TRACERGEN_AARECT_H
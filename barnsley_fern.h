@@ -7,29 +7,41 @@
 #include "hittable_list.h"
 #include "cylinder.h"
 #include "sphere.h"
-#include <random>
 
 class BarnsleyFern : public hittable {
 public:
     BarnsleyFern(int num_points, double scale, shared_ptr<material> mat);
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool find_hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return fern_parts.find_hit(r, t_min, t_max, rec);
+    }
+    virtual void hit_packet(ray_packet& packet, uint32_t active, double t_min) const override {
+        fern_parts.hit_packet(packet, active, t_min);
+    }
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return fern_parts.occluded(r, t_min, t_max);
+    }
+    virtual uint32_t occluded_packet(ray_packet& packet, uint32_t active, double t_min) const override {
+        return fern_parts.occluded_packet(packet, active, t_min);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const override;
+    virtual void finalize(double t0, double t1, build_report& report) override {
+        fern_parts.finalize(t0, t1, report);
+    }
 
 private:
     hittable_list fern_parts;
-    std::pair<double, double> iterate_point(double x, double y) const;
+    std::pair<double, double> iterate_point(double x, double y, sampler &rng) const;
 };
 
 BarnsleyFern::BarnsleyFern(int num_points, double scale, shared_ptr<material> mat) {
+    auto &rng = thread_sampler();
     double x = 0;
     double y = 0;
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0.0, 1.0);
 
     for (int i = 0; i < num_points; ++i) {
-        auto [x_new, y_new] = iterate_point(x, y);
+        auto [x_new, y_new] = iterate_point(x, y, rng);
         x = x_new;
         y = y_new;
 
@@ -46,11 +58,8 @@ bool BarnsleyFern::bounding_box(double t0, double t1, aabb& output_box) const {
     return fern_parts.bounding_box(t0, t1, output_box);
 }
 
-std::pair<double, double> BarnsleyFern::iterate_point(double x, double y) const {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<> dis(0.0, 1.0);
-    double r = dis(gen);
+std::pair<double, double> BarnsleyFern::iterate_point(double x, double y, sampler &rng) const {
+    double r = random_double(rng);
 
     if (r < 0.01) {
         return {0, 0.16 * y};
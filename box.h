@@ -3,16 +3,45 @@
 
 #include "utility.h"
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
+
+#include <utility>
 
 class box : public hittable {
 public:
     box() {}
 
-    box(const point3 &p0, const point3 &p1, shared_ptr<material> ptr);
+    box(const point3 &p0, const point3 &p1, shared_ptr<material> ptr)
+            : box_min(p0), box_max(p1), mat_ptr(ptr) {}
+
+    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        if (!find_hit(r, t_min, t_max, rec))
+            return false;
+        finish_hit(r, rec);
+        return true;
+    }
+
+    // The face axis is kept as the hit primitive.
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        TRACERGEN_COUNT(stat_box_primitive_tests);
+        double t;
+        int axis;
+        if (!find_face(r, t_min, t_max, t, axis))
+            return false;
+        rec.t = t;
+        rec.object = this;
+        rec.primitive = axis;
+        return true;
+    }
 
-    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+    virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_box_primitive_tests);
+        double t;
+        int axis;
+        return find_face(r, t_min, t_max, t, axis);
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         output_box = aabb(box_min, box_max);
@@ -22,25 +51,60 @@ public:
 public:
     point3 box_min;
     point3 box_max;
-    hittable_list sides;
-};
+    shared_ptr<material> mat_ptr;
 
-inline box::box(const point3 &p0, const point3 &p1, shared_ptr<material> ptr) {
-    box_min = p0;
-    box_max = p1;
-
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+private:
+    // Distance to the face the ray hits within [t_min, t_max], and that face's axis.
+    bool find_face(const ray &r, double t_min, double t_max, double &t, int &axis) const;
+};
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+inline bool box::find_face(const ray &r, double t_min, double t_max, double &t, int &axis) const {
+    // Slab test, remembering the axis of the entry and exit planes.
+    double t_enter = -infinity;
+    double t_exit = infinity;
+    int enter_axis = 0;
+    int exit_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        auto inv_d = 1.0 / r.direction()[a];
+        auto t0 = (box_min[a] - r.origin()[a]) * inv_d;
+        auto t1 = (box_max[a] - r.origin()[a]) * inv_d;
+        if (inv_d < 0.0)
+            std::swap(t0, t1);
+        if (t0 > t_enter) {
+            t_enter = t0;
+            enter_axis = a;
+        }
+        if (t1 < t_exit) {
+            t_exit = t1;
+            exit_axis = a;
+        }
+    }
+    if (t_exit < t_enter)
+        return false;
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    // Rays starting inside the box hit its exit face.
+    axis = enter_axis;
+    t = t_enter;
+    if (t < t_min) {
+        axis = exit_axis;
+        t = t_exit;
+    }
+    return t >= t_min && t <= t_max;
 }
 
-inline bool box::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+inline void box::finish_hit(const ray &r, hit_record &rec) const {
+    int axis = rec.primitive;
+    rec.p = r.at(rec.t);
+    // Same uv parametrization as the xy_rect, xz_rect and yz_rect faces.
+    int u_axis = axis == 0 ? 1 : 0;
+    int v_axis = axis == 2 ? 1 : 2;
+    rec.u = (rec.p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+    rec.v = (rec.p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = 1;
+    rec.set_face_normal(r, outward_normal);
+    rec.mat_ptr = mat_ptr.get();
+
 }
 
 
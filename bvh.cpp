@@ -0,0 +1,34 @@
+// hittable_list::finalize builds a bvh_node, and bvh.h needs hittable_list, so the two
+// meet here instead of in either header.
+
+#include "bvh.h"
+
+#include <chrono>
+#include <iostream>
+
+void hittable_list::finalize(double time0, double time1, build_report &report) {
+    for (auto &object: objects) {
+        object = collapse_transforms(object, report);
+        object->finalize(time0, time1, report);
+    }
+
+    aabb list_box;
+    if (objects.size() <= bvh_builder::max_prims_in_leaf || !bounding_box(time0, time1, list_box))
+        return;
+
+    auto node = make_shared<bvh_node>(*this, time0, time1);
+    report.bvh_count++;
+    report.primitive_count += objects.size();
+    objects.assign(1, node);
+}
+
+void finalize_scene(hittable_list &world, double time0, double time1) {
+    auto start = std::chrono::high_resolution_clock::now();
+    build_report report;
+    world.finalize(time0, time1, report);
+    auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    std::cout << "Built " << report.bvh_count << " BVHs over " << report.primitive_count
+              << " primitives in " << elapsed << " s, collapsed " << report.collapsed_transforms
+              << " transform chains\n";
+}
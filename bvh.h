@@ -2,154 +2,967 @@
 #define TRACERGEN_BVH_H
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <tbb/parallel_invoke.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "utility.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "aabb.h"
+#include "instance.h"
+
+// Branching factor of the BVH used for traversal, selected at build time: 2 keeps the
+// binary tree, 4 (SSE/NEON) and 8 (AVX) collapse it into a wide BVH whose child boxes
+// are tested against a ray all at once.
+#ifndef TRACERGEN_BVH_WIDTH
+#define TRACERGEN_BVH_WIDTH 4
+#endif
+
+static_assert(TRACERGEN_BVH_WIDTH == 2 || TRACERGEN_BVH_WIDTH == 4 || TRACERGEN_BVH_WIDTH == 8,
+              "TRACERGEN_BVH_WIDTH must be 2, 4 or 8");
+
+// Flattened BVH node. Nodes are stored in depth-first order, so the first child of an
+// interior node always directly follows it and only the second child needs an offset.
+// Bounds are kept in single precision (rounded outwards) to fit a node in 32 bytes,
+// which puts two nodes in every 64-byte cache line.
+struct linear_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    union {
+        int primitives_offset;   // leaf
+        int second_child_offset; // interior
+    };
+    uint16_t n_primitives;       // 0 -> interior node
+    uint8_t axis;                // interior node split axis
+    uint8_t pad;
+
+    void set_bounds(const aabb &b) {
+        for (int a = 0; a < 3; a++) {
+            bounds_min[a] = round_down(b.min()[a]);
+            bounds_max[a] = round_up(b.max()[a]);
+        }
+    }
 
-class bvh_node : public hittable {
+    bool hit(const ray &r, const vec3 &inv_dir, double t_min, double t_max) const {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (bounds_min[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (bounds_max[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0.0)
+                std::swap(t0, t1);
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    static float round_down(double x) {
+        auto f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float round_up(double x) {
+        auto f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node must stay 32 bytes");
+
+// Binned SAH builder. Primitive bounds and centroids are computed once into flat arrays
+// and the builder only permutes an index array in place, so no level of the recursion
+// copies or allocates. Every subtree over n primitives is given a budget of 2n - 1 node
+// slots directly after its parent, which lets both halves be built concurrently while
+// keeping the depth-first layout; unused slots are squeezed out in a final pass.
+class bvh_builder {
 public:
-    bvh_node();
+    static constexpr int n_bins = 16;
+    static constexpr int max_prims_in_leaf = 4;
+    static constexpr int max_depth = 64;
+    static constexpr size_t parallel_threshold = 4096;
+
+    // Builds a flattened BVH over prim_boxes. Leaves reference ranges of prim_order.
+    // leaf_batch is the number of primitives a leaf intersects for the price of one, so
+    // owners that test a whole leaf at once get fuller leaves from the SAH.
+    static void build(const std::vector<aabb> &prim_boxes,
+                      std::vector<linear_bvh_node> &nodes, std::vector<int> &prim_order,
+                      int leaf_batch = 1);
+
+private:
+    // Plain min/max accumulator; avoids the fmin/fmax calls of surrounding_box() in the
+    // inner binning loops.
+    struct bounds {
+        double lo[3] = {infinity, infinity, infinity};
+        double hi[3] = {-infinity, -infinity, -infinity};
+
+        void grow(const point3 &p) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], p[a]);
+                hi[a] = std::max(hi[a], p[a]);
+            }
+        }
 
-    bvh_node(const hittable_list &list, double time0, double time1)
-            : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+        void grow(const aabb &b) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], b.minimum[a]);
+                hi[a] = std::max(hi[a], b.maximum[a]);
+            }
+        }
 
-    bvh_node(const std::vector<shared_ptr<hittable>> &src_objects,
-             size_t start, size_t end, double time0, double time1);
+        void grow(const bounds &b) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], b.lo[a]);
+                hi[a] = std::max(hi[a], b.hi[a]);
+            }
+        }
 
-    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+        double area() const {
+            if (lo[0] > hi[0])
+                return 0.0;
+            auto a = hi[0] - lo[0];
+            auto b = hi[1] - lo[1];
+            auto c = hi[2] - lo[2];
+            return 2 * (a * b + b * c + c * a);
+        }
 
-    virtual bool bounding_box(double time0, double time1, aabb &output_box) const override;
+        aabb to_aabb() const {
+            return aabb(point3(lo[0], lo[1], lo[2]), point3(hi[0], hi[1], hi[2]));
+        }
+    };
 
-public:
-    std::array<shared_ptr<hittable>, 2> children;
-    aabb box;
+    struct bin {
+        bounds box;
+        int count = 0;
+    };
+
+    bvh_builder(const std::vector<aabb> &prim_boxes, std::vector<int> &prim_order, int leaf_batch)
+            : boxes(prim_boxes), order(prim_order), centroids(prim_boxes.size()), batch(leaf_batch) {}
+
+    // Cost of intersecting n primitives, in units of one primitive test.
+    double prim_cost(size_t n) const {
+        return static_cast<double>((n + batch - 1) / batch);
+    }
+
+    void build_recursive(int node_index, size_t start, size_t end, int depth);
+
+    int compact(int sparse_index, std::vector<linear_bvh_node> &dense) const;
+
+    const std::vector<aabb> &boxes;
+    std::vector<int> &order;
+    std::vector<point3> centroids;
+    std::vector<linear_bvh_node> sparse_nodes;
+    int batch;
 };
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
+inline void bvh_builder::build(const std::vector<aabb> &prim_boxes,
+                               std::vector<linear_bvh_node> &nodes, std::vector<int> &prim_order,
+                               int leaf_batch) {
+    nodes.clear();
+    prim_order.resize(prim_boxes.size());
+    if (prim_boxes.empty())
+        return;
+
+    bvh_builder builder(prim_boxes, prim_order, leaf_batch);
+    for (size_t i = 0; i < prim_boxes.size(); i++) {
+        builder.centroids[i] = 0.5 * (prim_boxes[i].min() + prim_boxes[i].max());
+        prim_order[i] = static_cast<int>(i);
+    }
+
+    builder.sparse_nodes.resize(2 * prim_boxes.size() - 1);
+    builder.build_recursive(0, 0, prim_boxes.size(), 0);
+
+    nodes.reserve(builder.sparse_nodes.size());
+    builder.compact(0, nodes);
+    nodes.shrink_to_fit();
+}
+
+inline void bvh_builder::build_recursive(int node_index, size_t start, size_t end, int depth) {
+    linear_bvh_node &node = sparse_nodes[node_index];
+
+    bounds full_box, centroid_box;
+    for (size_t i = start; i < end; i++) {
+        full_box.grow(boxes[order[i]]);
+        centroid_box.grow(centroids[order[i]]);
+    }
+    node.set_bounds(full_box.to_aabb());
+
+    size_t object_span = end - start;
+    if (object_span == 1) {
+        node.primitives_offset = static_cast<int>(start);
+        node.n_primitives = 1;
+        return;
+    }
+
+    // Bin the centroids along every axis and evaluate the SAH at each bin boundary.
+    int best_axis = -1;
+    int best_split = 0;
+    double best_cost = infinity;
+
+    if (depth < max_depth) {
+        // A single pass over the primitives fills the bins of all three axes.
+        bin bins[3][n_bins];
+        double scale[3];
+        for (int axis = 0; axis < 3; axis++) {
+            double extent = centroid_box.hi[axis] - centroid_box.lo[axis];
+            scale[axis] = extent > 0 ? n_bins / extent : 0.0;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            const point3 &c = centroids[order[i]];
+            const aabb &prim_box = boxes[order[i]];
+            for (int axis = 0; axis < 3; axis++) {
+                int b = std::min(n_bins - 1, static_cast<int>((c[axis] - centroid_box.lo[axis]) * scale[axis]));
+                bins[axis][b].box.grow(prim_box);
+                bins[axis][b].count++;
+            }
+        }
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0.0)
+                continue;
+
+            double right_area[n_bins];
+            int right_count[n_bins];
+            bounds right_box;
+            int count = 0;
+            for (int b = n_bins - 1; b > 0; b--) {
+                right_box.grow(bins[axis][b].box);
+                count += bins[axis][b].count;
+                right_count[b] = count;
+                right_area[b] = right_box.area();
+            }
+
+            bounds left_box;
+            count = 0;
+            for (int b = 0; b < n_bins - 1; b++) {
+                left_box.grow(bins[axis][b].box);
+                count += bins[axis][b].count;
+                if (count == 0 || right_count[b + 1] == 0)
+                    continue;
+
+                double cost = prim_cost(count) * left_box.area() + prim_cost(right_count[b + 1]) * right_area[b + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = b + 1;
+                }
+            }
+        }
+    }
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    size_t split_index;
+    if (best_axis >= 0) {
+        // Splitting costs one extra box test (weighted at 1/8 of a primitive test) plus
+        // the expected primitive tests of both children.
+        double split_cost = 0.125 + best_cost / full_box.area();
+        if (object_span <= max_prims_in_leaf && split_cost >= prim_cost(object_span)) {
+            node.primitives_offset = static_cast<int>(start);
+            node.n_primitives = static_cast<uint16_t>(object_span);
+            return;
+        }
+
+        double cmin = centroid_box.lo[best_axis];
+        double scale = n_bins / (centroid_box.hi[best_axis] - cmin);
+        auto mid = std::partition(order.begin() + start, order.begin() + end, [&](int i) {
+            int b = std::min(n_bins - 1, static_cast<int>((centroids[i][best_axis] - cmin) * scale));
+            return b < best_split;
+        });
+        split_index = mid - order.begin();
+        node.axis = static_cast<uint8_t>(best_axis);
+    } else {
+        // Coincident centroids or a too deep tree: fall back to a median split.
+        if (object_span <= max_prims_in_leaf) {
+            node.primitives_offset = static_cast<int>(start);
+            node.n_primitives = static_cast<uint16_t>(object_span);
+            return;
+        }
+
+        int axis = centroid_box.to_aabb().longest_axis();
+        split_index = start + object_span / 2;
+        std::nth_element(order.begin() + start, order.begin() + split_index, order.begin() + end,
+                         [&](int a, int b) { return centroids[a][axis] < centroids[b][axis]; });
+        node.axis = static_cast<uint8_t>(axis);
+    }
 
-    return box_a.min().e[axis] < box_b.min().e[axis];
+    node.n_primitives = 0;
+    int left_index = node_index + 1;
+    int right_index = node_index + 2 * static_cast<int>(split_index - start);
+    node.second_child_offset = right_index;
+
+    if (object_span >= parallel_threshold) {
+        // Use oneTBB's parallel_invoke to construct child nodes in parallel
+        tbb::parallel_invoke(
+                [&] { build_recursive(left_index, start, split_index, depth + 1); },
+                [&] { build_recursive(right_index, split_index, end, depth + 1); }
+        );
+    } else {
+        build_recursive(left_index, start, split_index, depth + 1);
+        build_recursive(right_index, split_index, end, depth + 1);
+    }
 }
 
+inline int bvh_builder::compact(int sparse_index, std::vector<linear_bvh_node> &dense) const {
+    int dense_index = static_cast<int>(dense.size());
+    dense.push_back(sparse_nodes[sparse_index]);
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+    if (sparse_nodes[sparse_index].n_primitives == 0) {
+        compact(sparse_index + 1, dense);
+        int second = compact(sparse_nodes[sparse_index].second_child_offset, dense);
+        dense[dense_index].second_child_offset = second;
+    }
+
+    return dense_index;
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+// Wide BVH node. Child boxes are stored structure-of-arrays so one slab test covers all
+// W children; unused slots have inverted bounds and never report a hit.
+template <int W>
+struct alignas(32) wide_bvh_node {
+    float bounds[2][3][W]; // [min/max][axis][child]
+    int32_t child[W];      // wide node index of an interior child, first primitive of a leaf
+    uint32_t count[W];     // number of primitives of a leaf child, 0 for an interior child
+};
+
+// Ray in the single precision form used by the wide slab test.
+struct wide_ray {
+    float org[3];
+    float inv_dir[3];
+    int neg[3];
+
+    wide_ray() {}
+
+    explicit wide_ray(const ray &r) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = static_cast<float>(r.origin()[a]);
+            inv_dir[a] = 1.0f / static_cast<float>(r.direction()[a]);
+            neg[a] = inv_dir[a] < 0;
+        }
+    }
+};
+
+// Slab test of one ray against 4 children starting at lane k. Returns the hit mask and
+// stores the entry distances. The near plane of every axis is picked from the ray
+// direction sign, so no per-lane swap is needed; NaNs (ray origin on a slab of a
+// direction component equal to zero) are ignored by operand order.
+template <int W>
+inline int slab_test4(const wide_bvh_node<W> &node, const wide_ray &wr, int k,
+                      float t_min, float t_max, float *t_near) {
+    // Widen the far distance by 2 * gamma(3) so float rounding never culls a box.
+    const float far_scale = 1.0f + 2.0f * 3.0f * 0x1p-24f / (1.0f - 3.0f * 0x1p-24f);
+#if defined(__SSE2__)
+    __m128 tn = _mm_set1_ps(t_min);
+    __m128 tf = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m128 o = _mm_set1_ps(wr.org[a]);
+        __m128 inv = _mm_set1_ps(wr.inv_dir[a]);
+        __m128 n = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[wr.neg[a]][a] + k), o), inv);
+        __m128 f = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - wr.neg[a]][a] + k), o), inv);
+        tn = _mm_max_ps(n, tn);
+        tf = _mm_min_ps(_mm_mul_ps(f, _mm_set1_ps(far_scale)), tf);
+    }
+    _mm_storeu_ps(t_near + k, tn);
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf)) << k;
+#elif defined(__ARM_NEON)
+    float32x4_t tn = vdupq_n_f32(t_min);
+    float32x4_t tf = vdupq_n_f32(t_max);
+    for (int a = 0; a < 3; a++) {
+        float32x4_t o = vdupq_n_f32(wr.org[a]);
+        float32x4_t inv = vdupq_n_f32(wr.inv_dir[a]);
+        float32x4_t n = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[wr.neg[a]][a] + k), o), inv);
+        float32x4_t f = vmulq_f32(vsubq_f32(vld1q_f32(node.bounds[1 - wr.neg[a]][a] + k), o), inv);
+        tn = vmaxnmq_f32(n, tn);
+        tf = vminnmq_f32(vmulq_n_f32(f, far_scale), tf);
+    }
+    vst1q_f32(t_near + k, tn);
+    const uint32x4_t lane_bits = {1, 2, 4, 8};
+    return static_cast<int>(vaddvq_u32(vandq_u32(vcleq_f32(tn, tf), lane_bits))) << k;
+#else
+    int mask = 0;
+    for (int i = k; i < k + 4; i++) {
+        float tn = t_min;
+        float tf = t_max;
+        for (int a = 0; a < 3; a++) {
+            float n = (node.bounds[wr.neg[a]][a][i] - wr.org[a]) * wr.inv_dir[a];
+            float f = (node.bounds[1 - wr.neg[a]][a][i] - wr.org[a]) * wr.inv_dir[a] * far_scale;
+            tn = n > tn ? n : tn;
+            tf = f < tf ? f : tf;
+        }
+        t_near[i] = tn;
+        mask |= (tn <= tf) << i;
+    }
+    return mask;
+#endif
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+// Slab test of one ray against all W children of a wide node.
+template <int W>
+inline int slab_test(const wide_bvh_node<W> &node, const wide_ray &wr, float t_min, float t_max, float *t_near) {
+#if defined(__AVX__)
+    if constexpr (W == 8) {
+        const float far_scale = 1.0f + 2.0f * 3.0f * 0x1p-24f / (1.0f - 3.0f * 0x1p-24f);
+        __m256 tn = _mm256_set1_ps(t_min);
+        __m256 tf = _mm256_set1_ps(t_max);
+        for (int a = 0; a < 3; a++) {
+            __m256 o = _mm256_set1_ps(wr.org[a]);
+            __m256 inv = _mm256_set1_ps(wr.inv_dir[a]);
+            __m256 n = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[wr.neg[a]][a]), o), inv);
+            __m256 f = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds[1 - wr.neg[a]][a]), o), inv);
+            tn = _mm256_max_ps(n, tn);
+            tf = _mm256_min_ps(_mm256_mul_ps(f, _mm256_set1_ps(far_scale)), tf);
+        }
+        _mm256_storeu_ps(t_near, tn);
+        return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+    }
+#endif
+    int mask = 0;
+    for (int k = 0; k < W; k += 4)
+        mask |= slab_test4(node, wr, k, t_min, t_max, t_near);
+    return mask;
 }
 
-bvh_node::bvh_node(
-        const std::vector<shared_ptr<hittable>> &src_objects,
-        size_t start, size_t end, double time0, double time1
-) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
+// Acceleration structure over an abstract set of primitives given by their boxes. Leaves
+// reference ranges of the primitive order returned by build(); the owner stores its
+// primitives in that order and intersects them in the traverse() callback.
+class bvh_accel {
+public:
+    static constexpr int width = TRACERGEN_BVH_WIDTH;
+    static constexpr int traversal_stack_size = 2 * bvh_builder::max_depth;
+    // Packet traversal hands a subtree to single-ray traversal once fewer rays reach it.
+    static constexpr int packet_split = 2;
+
+    void build(const std::vector<aabb> &prim_boxes, std::vector<int> &prim_order, int leaf_batch = 1);
+
+    bool empty() const { return nodes.empty() && wide_nodes.empty(); }
+
+    // Calls intersect_leaf(first, count, t_max) for the leaves the ray reaches, roughly
+    // nearest first. The callback returns true when it found a hit closer than t_max and
+    // lowered t_max to it; lowering it below t_min ends the traversal, which is how
+    // occlusion queries stop at their first hit.
+    template <typename LeafFn>
+    bool traverse(const ray &r, double t_min, double t_max, LeafFn &&intersect_leaf) const;
+
+    // Packet version of traverse() for the rays of packet selected by active: each node is
+    // fetched once and tested against every ray that reached it. Calls
+    // intersect_leaf(first, count, rays), where the mask rays selects the rays that reached
+    // the leaf; the callback lowers their packet.t_max when it finds closer hits, and to
+    // -infinity for the rays it is done with.
+    template <typename LeafFn>
+    void traverse_packet(ray_packet &packet, uint32_t active, double t_min, LeafFn &&intersect_leaf) const;
+
+    // Calls remap(first, count) once per leaf and stores the result as the leaf's first
+    // primitive, so an owner can repack the primitives of each leaf into its own layout.
+    template <typename RemapFn>
+    void remap_leaves(RemapFn &&remap);
 
-    aabb full_box;
-    for (size_t i = start; i < end; i++) {
-        aabb temp_box;
-        if (!objects[i]->bounding_box(time0, time1, temp_box))
-            std::cerr << "No bounding box in bvh_node constructor.\n";
-        full_box = surrounding_box(full_box, temp_box);
+public:
+    std::vector<linear_bvh_node> nodes; // binary layout, kept when width == 2
+    std::vector<wide_bvh_node<width>> wide_nodes;
+
+private:
+    int collapse(int binary_index);
+
+    template <typename LeafFn>
+    bool traverse_binary(const ray &r, double t_min, double t_max, LeafFn &&intersect_leaf) const;
+
+    template <typename LeafFn>
+    bool traverse_wide(int root, const ray &r, double t_min, double t_max, LeafFn &&intersect_leaf) const;
+
+    template <typename LeafFn>
+    void traverse_packet_wide(ray_packet &packet, uint32_t active, double t_min, LeafFn &&intersect_leaf) const;
+
+    // Traces ray i of packet alone through the subtree rooted at root.
+    template <typename LeafFn>
+    void traverse_single(int root, ray_packet &packet, int i, double t_min, LeafFn &&intersect_leaf) const {
+        auto leaf = [&](int first, int count, double &closest) {
+            intersect_leaf(first, count, 1u << i);
+            bool closer = packet.t_max[i] < closest;
+            closest = packet.t_max[i];
+            return closer;
+        };
+        if constexpr (width > 2)
+            traverse_wide(root, packet.rays[i], t_min, packet.t_max[i], leaf);
+        else
+            traverse_binary(packet.rays[i], t_min, packet.t_max[i], leaf);
     }
+};
 
-    int axis = full_box.longest_axis();
-    auto comparator = (axis == 0) ? box_x_compare
-                                  : (axis == 1) ? box_y_compare
-                                                : box_z_compare;
+inline void bvh_accel::build(const std::vector<aabb> &prim_boxes, std::vector<int> &prim_order, int leaf_batch) {
+    bvh_builder::build(prim_boxes, nodes, prim_order, leaf_batch);
+    wide_nodes.clear();
 
-    size_t object_span = end - start;
+    if constexpr (width > 2) {
+        if (!nodes.empty()) {
+            collapse(0);
+            nodes.clear();
+            nodes.shrink_to_fit();
+        }
+    }
+}
 
-    if (object_span == 1) {
-        children[0] = children[1] = objects[start];
-    } else if (object_span == 2) {
-        children[0] = objects[start + (comparator(objects[start], objects[start + 1]) ? 0 : 1)];
-        children[1] = objects[start + (comparator(objects[start], objects[start + 1]) ? 1 : 0)];
+// Turns the binary subtree rooted at binary_index into a wide node by repeatedly
+// replacing the interior child with the largest surface area by its two children.
+inline int bvh_accel::collapse(int binary_index) {
+    auto area = [this](int i) {
+        const auto &n = nodes[i];
+        float a = n.bounds_max[0] - n.bounds_min[0];
+        float b = n.bounds_max[1] - n.bounds_min[1];
+        float c = n.bounds_max[2] - n.bounds_min[2];
+        return a * b + b * c + c * a;
+    };
+
+    int slots[width];
+    int n_slots = 0;
+    if (nodes[binary_index].n_primitives > 0) {
+        slots[n_slots++] = binary_index;
     } else {
-        // Implement Surface Area Heuristic (SAH) for BVH construction
-        std::vector<aabb> left_boxes(object_span);
-        std::vector<aabb> right_boxes(object_span);
-        aabb left_box, right_box;
+        slots[n_slots++] = binary_index + 1;
+        slots[n_slots++] = nodes[binary_index].second_child_offset;
+    }
 
-        for (size_t i = start; i < end; i++) {
-            aabb temp_box;
-            if (!objects[i]->bounding_box(time0, time1, temp_box))
-                std::cerr << "No bounding box in bvh_node constructor.\n";
-            left_box = surrounding_box(left_box, temp_box);
-            left_boxes[i - start] = left_box;
+    while (n_slots < width) {
+        int best = -1;
+        for (int i = 0; i < n_slots; i++) {
+            if (nodes[slots[i]].n_primitives == 0 && (best < 0 || area(slots[i]) > area(slots[best])))
+                best = i;
         }
+        if (best < 0)
+            break;
 
-        for (size_t i = end; i > start; i--) {
-            aabb temp_box;
-            if (!objects[i - 1]->bounding_box(time0, time1, temp_box))
-                std::cerr << "No bounding box in bvh_node constructor.\n";
-            right_box = surrounding_box(right_box, temp_box);
-            right_boxes[i - start - 1] = right_box;
+        int expanded = slots[best];
+        slots[best] = expanded + 1;
+        slots[n_slots++] = nodes[expanded].second_child_offset;
+    }
+
+    int wide_index = static_cast<int>(wide_nodes.size());
+    wide_nodes.emplace_back();
+    for (int i = 0; i < width; i++) {
+        auto &wide = wide_nodes[wide_index];
+        if (i >= n_slots) {
+            for (int a = 0; a < 3; a++) {
+                wide.bounds[0][a][i] = std::numeric_limits<float>::infinity();
+                wide.bounds[1][a][i] = -std::numeric_limits<float>::infinity();
+            }
+            wide.child[i] = -1;
+            wide.count[i] = 0;
+            continue;
         }
 
-        double min_cost = std::numeric_limits<double>::infinity();
-        size_t split_index = start;
+        const linear_bvh_node &n = nodes[slots[i]];
+        for (int a = 0; a < 3; a++) {
+            wide.bounds[0][a][i] = n.bounds_min[a];
+            wide.bounds[1][a][i] = n.bounds_max[a];
+        }
+
+        if (n.n_primitives > 0) {
+            wide.child[i] = n.primitives_offset;
+            wide.count[i] = n.n_primitives;
+        } else {
+            // collapse() appends to wide_nodes, so the reference above must not be reused.
+            int child = collapse(slots[i]);
+            wide_nodes[wide_index].child[i] = child;
+            wide_nodes[wide_index].count[i] = 0;
+        }
+    }
 
-        for (size_t i = start; i < end - 1; i++) {
-            double left_area = left_boxes[i - start].area();
-            double right_area = right_boxes[i - start + 1].area();
-            double cost = (i - start + 1) * left_area + (end - i - 1) * right_area;
+    return wide_index;
+}
+
+template <typename RemapFn>
+inline void bvh_accel::remap_leaves(RemapFn &&remap) {
+    for (auto &node: nodes) {
+        if (node.n_primitives > 0)
+            node.primitives_offset = remap(node.primitives_offset, static_cast<int>(node.n_primitives));
+    }
+    for (auto &node: wide_nodes) {
+        for (int i = 0; i < width; i++) {
+            if (node.count[i] > 0)
+                node.child[i] = remap(node.child[i], static_cast<int>(node.count[i]));
+        }
+    }
+}
 
-            if (cost < min_cost) {
-                min_cost = cost;
-                split_index = i + 1;
+template <typename LeafFn>
+inline bool bvh_accel::traverse(const ray &r, double t_min, double t_max, LeafFn &&intersect_leaf) const {
+    if constexpr (width > 2)
+        return traverse_wide(0, r, t_min, t_max, intersect_leaf);
+    else
+        return traverse_binary(r, t_min, t_max, intersect_leaf);
+}
+
+template <typename LeafFn>
+inline void bvh_accel::traverse_packet(ray_packet &packet, uint32_t active, double t_min,
+                                       LeafFn &&intersect_leaf) const {
+    if constexpr (width > 2) {
+        traverse_packet_wide(packet, active, t_min, intersect_leaf);
+    } else {
+        // The binary layout has no packet traversal.
+        if (nodes.empty())
+            return;
+        while (active) {
+            int i = __builtin_ctz(active);
+            active &= active - 1;
+            traverse_single(0, packet, i, t_min, intersect_leaf);
+        }
+    }
+}
+
+template <typename LeafFn>
+inline bool bvh_accel::traverse_binary(const ray &r, double t_min, double t_max, LeafFn &&intersect_leaf) const {
+    if (nodes.empty())
+        return false;
+
+    vec3 inv_dir(1.0 / r.direction().x(), 1.0 / r.direction().y(), 1.0 / r.direction().z());
+    bool dir_is_neg[3] = {inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0};
+
+    int to_visit[traversal_stack_size];
+    int to_visit_offset = 0;
+    int current = 0;
+    bool hit_anything = false;
+
+    while (true) {
+        const linear_bvh_node &node = nodes[current];
+        TRACERGEN_COUNT(stat_bvh_nodes_visited);
+        TRACERGEN_COUNT(stat_box_tests);
+        if (node.hit(r, inv_dir, t_min, t_max)) {
+            if (node.n_primitives > 0) {
+                if (intersect_leaf(node.primitives_offset, static_cast<int>(node.n_primitives), t_max)) {
+                    hit_anything = true;
+                    if (t_max < t_min) break;
+                }
+                if (to_visit_offset == 0) break;
+                current = to_visit[--to_visit_offset];
+            } else {
+                // Visit the near child first so the far one is culled by the closer hit.
+                if (dir_is_neg[node.axis]) {
+                    to_visit[to_visit_offset++] = current + 1;
+                    current = node.second_child_offset;
+                } else {
+                    to_visit[to_visit_offset++] = node.second_child_offset;
+                    current = current + 1;
+                }
             }
+        } else {
+            if (to_visit_offset == 0) break;
+            current = to_visit[--to_visit_offset];
         }
+    }
 
-        // Use oneTBB's parallel_invoke to construct child nodes in parallel
-        tbb::parallel_invoke(
-            [&] { children[0] = make_shared<bvh_node>(objects, start, split_index, time0, time1); },
-            [&] { children[1] = make_shared<bvh_node>(objects, split_index, end, time0, time1); }
-        );
+    return hit_anything;
+}
 
-        // Reorder child nodes for better cache usage during traversal
-        aabb child_box0, child_box1;
-        if (!children[0]->bounding_box(time0, time1, child_box0) || !children[1]->bounding_box(time0, time1, child_box1))
-            std::cerr << "No bounding box in bvh_node constructor.\n";
+template <typename LeafFn>
+inline bool bvh_accel::traverse_wide(int root, const ray &r, double t_min, double t_max,
+                                     LeafFn &&intersect_leaf) const {
+    if (wide_nodes.empty())
+        return false;
 
-        if (child_box0.area() > child_box1.area()) {
-            std::swap(children[0], children[1]);
+    struct entry {
+        int child;
+        uint32_t count;
+        float t_near;
+    };
+
+    // Rounds the double precision interval outwards so the float test stays conservative.
+    auto float_below = [](double x) {
+        auto f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    };
+    auto float_above = [](double x) {
+        auto f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    };
+
+    const wide_ray wr(r);
+    const float ft_min = float_below(t_min);
+    float ft_max = float_above(t_max);
+
+    entry stack[(width - 1) * traversal_stack_size + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {root, 0, ft_min};
+    bool hit_anything = false;
+
+    alignas(32) float t_near[width];
+
+    while (stack_size > 0) {
+        const entry e = stack[--stack_size];
+        if (e.t_near > ft_max)
+            continue;
+
+        if (e.count > 0) {
+            if (intersect_leaf(e.child, static_cast<int>(e.count), t_max)) {
+                hit_anything = true;
+                if (t_max < t_min)
+                    break;
+                ft_max = float_above(t_max);
+            }
+            continue;
         }
+
+        const auto &node = wide_nodes[e.child];
+        TRACERGEN_COUNT(stat_bvh_nodes_visited);
+        TRACERGEN_COUNT_N(stat_box_tests, width);
+        int mask = slab_test(node, wr, ft_min, ft_max, t_near);
+
+        // Push the children hit far to near so the nearest one is popped first.
+        int first = stack_size;
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+
+            entry child = {node.child[i], node.count[i], t_near[i]};
+            int j = stack_size++;
+            while (j > first && stack[j - 1].t_near < child.t_near) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+
+    return hit_anything;
+}
+
+template <typename LeafFn>
+inline void bvh_accel::traverse_packet_wide(ray_packet &packet, uint32_t active, double t_min,
+                                            LeafFn &&intersect_leaf) const {
+    if (wide_nodes.empty() || !active)
+        return;
+
+    // An entry carries the rays that reached it and the nearest of their entry distances.
+    struct entry {
+        int child;
+        uint32_t count;
+        uint32_t rays;
+        float t_near;
+    };
+
+    auto float_below = [](double x) {
+        auto f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    };
+    auto float_above = [](double x) {
+        auto f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    };
+
+    wide_ray wr[ray_packet::max_size];
+    float ft_max[ray_packet::max_size];
+    for (uint32_t m = active; m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        wr[i] = wide_ray(packet.rays[i]);
+        ft_max[i] = float_above(packet.t_max[i]);
     }
+    const float ft_min = float_below(t_min);
+
+    entry stack[(width - 1) * traversal_stack_size + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, active, ft_min};
 
-    aabb box_left, box_right;
-    if (!children[0]->bounding_box(time0, time1, box_left)
-        || !children[1]->bounding_box(time0, time1, box_right)
-            )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    alignas(32) float t_near[width];
 
-    box = surrounding_box(box_left, box_right);
+    while (stack_size > 0) {
+        const entry e = stack[--stack_size];
+
+        // Drop the rays whose closest hit is nearer than every ray's entry into this child.
+        uint32_t rays = e.rays;
+        for (uint32_t m = rays; m; m &= m - 1) {
+            int i = __builtin_ctz(m);
+            if (e.t_near > ft_max[i])
+                rays &= ~(1u << i);
+        }
+        if (!rays)
+            continue;
+
+        if (e.count > 0) {
+            intersect_leaf(e.child, static_cast<int>(e.count), rays);
+            for (uint32_t m = rays; m; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                ft_max[i] = float_above(packet.t_max[i]);
+            }
+            continue;
+        }
+
+        // The packet has diverged: the remaining rays finish this subtree alone, each in
+        // its own nearest-first order.
+        if (__builtin_popcount(rays) < packet_split) {
+            for (uint32_t m = rays; m; m &= m - 1) {
+                int i = __builtin_ctz(m);
+                traverse_single(e.child, packet, i, t_min, intersect_leaf);
+                ft_max[i] = float_above(packet.t_max[i]);
+            }
+            continue;
+        }
+
+        const auto &node = wide_nodes[e.child];
+        TRACERGEN_COUNT(stat_bvh_nodes_visited);
+        TRACERGEN_COUNT_N(stat_box_tests, width * __builtin_popcount(rays));
+
+        uint32_t child_rays[width] = {};
+        float child_near[width];
+        for (int c = 0; c < width; c++)
+            child_near[c] = std::numeric_limits<float>::infinity();
+
+        for (uint32_t m = rays; m; m &= m - 1) {
+            int i = __builtin_ctz(m);
+            int mask = slab_test(node, wr[i], ft_min, ft_max[i], t_near);
+            while (mask) {
+                int c = __builtin_ctz(mask);
+                mask &= mask - 1;
+                child_rays[c] |= 1u << i;
+                child_near[c] = std::min(child_near[c], t_near[c]);
+            }
+        }
+
+        // Push the children reached far to near, as in traverse_wide.
+        int first = stack_size;
+        for (int c = 0; c < width; c++) {
+            if (!child_rays[c])
+                continue;
+
+            entry child = {node.child[c], node.count[c], child_rays[c], child_near[c]};
+            int j = stack_size++;
+            while (j > first && stack[j - 1].t_near < child.t_near) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
 }
 
-bool bvh_node::bounding_box(double time0, double time1, aabb &output_box) const {
+class bvh_node : public hittable {
+public:
+    bvh_node() {}
+
+    bvh_node(const hittable_list &list, double time0, double time1)
+            : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
+
+    bvh_node(const std::vector<shared_ptr<hittable>> &src_objects,
+             size_t start, size_t end, double time0, double time1);
+
+    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        if (!find_hit(r, t_min, t_max, rec))
+            return false;
+        rec.object->finish_hit(r, rec);
+        return true;
+    }
+
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    virtual void hit_packet(ray_packet &packet, uint32_t active, double t_min) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
+    virtual uint32_t occluded_packet(ray_packet &packet, uint32_t active, double t_min) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb &output_box) const override;
+
+    // The tree is already built; only the primitives are finalized.
+    virtual void finalize(double time0, double time1, build_report &report) override {
+        for (auto &primitive: primitives) {
+            primitive = collapse_transforms(primitive, report);
+            primitive->finalize(time0, time1, report);
+        }
+    }
+
+public:
+    // Objects reordered so that every leaf references a contiguous range.
+    std::vector<shared_ptr<hittable>> primitives;
+    bvh_accel accel;
+    aabb box;
+};
+
+inline bvh_node::bvh_node(
+        const std::vector<shared_ptr<hittable>> &src_objects,
+        size_t start, size_t end, double time0, double time1
+) {
+    if (start >= end)
+        return;
+
+    // Query every bounding box exactly once up front.
+    std::vector<aabb> prim_boxes(end - start);
+    for (size_t i = start; i < end; i++) {
+        if (!src_objects[i]->bounding_box(time0, time1, prim_boxes[i - start]))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        box = i == start ? prim_boxes[0] : surrounding_box(box, prim_boxes[i - start]);
+    }
+
+    std::vector<int> prim_order;
+    accel.build(prim_boxes, prim_order);
+
+    primitives.resize(prim_order.size());
+    for (size_t i = 0; i < prim_order.size(); i++)
+        primitives[i] = src_objects[start + prim_order[i]];
+}
+
+inline bool bvh_node::bounding_box(double time0, double time1, aabb &output_box) const {
     output_box = box;
     return true;
 }
 
-bool bvh_node::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    if (!box.hit(r, t_min, t_max))
-        return false;
+inline bool bvh_node::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    return accel.traverse(r, t_min, t_max, [&](int first, int count, double &closest) {
+        bool hit_anything = false;
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->find_hit(r, t_min, closest, rec)) {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        }
+        return hit_anything;
+    });
+}
+
+inline void bvh_node::hit_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    accel.traverse_packet(packet, active, t_min, [&](int first, int count, uint32_t rays) {
+        for (int i = first; i < first + count; i++)
+            primitives[i]->hit_packet(packet, rays, t_min);
+    });
+}
 
-    bool hit_left = children[0]->hit(r, t_min, t_max, rec);
-    bool hit_right = children[1]->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+inline bool bvh_node::occluded(const ray &r, double t_min, double t_max) const {
+    return accel.traverse(r, t_min, t_max, [&](int first, int count, double &closest) {
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->occluded(r, t_min, closest)) {
+                closest = -infinity;
+                return true;
+            }
+        }
+        return false;
+    });
+}
 
-    return hit_left || hit_right;
+inline uint32_t bvh_node::occluded_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    uint32_t blocked = 0;
+    accel.traverse_packet(packet, active, t_min, [&](int first, int count, uint32_t rays) {
+        for (int i = first; i < first + count && rays; i++) {
+            uint32_t hit = primitives[i]->occluded_packet(packet, rays, t_min);
+            blocked |= hit;
+            rays &= ~hit;
+            for (; hit; hit &= hit - 1)
+                packet.t_max[__builtin_ctz(hit)] = -infinity;
+        }
+    });
+    return blocked;
 }
 
+// Builds the acceleration structures of a scene and prints what was built. Defined in
+// bvh.cpp, next to hittable_list::finalize.
+void finalize_scene(hittable_list &world, double time0, double time1);
+
 #endif //TRACERGEN_BVH_H
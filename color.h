@@ -5,7 +5,7 @@
 
 #include <iostream>
 
-void write_color(std::vector<unsigned char> &image_data, int index, color pixel_color, int samples_per_pixel) {
+void write_color(std::vector<unsigned char> &image_data, size_t index, color pixel_color, int samples_per_pixel) {
     auto r = pixel_color.x();
     auto g = pixel_color.y();
     auto b = pixel_color.z();
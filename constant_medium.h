@@ -4,6 +4,7 @@
 #include "utility.h"
 
 #include "hittable.h"
+#include "instance.h"
 #include "texture.h"
 #include "material.h"
 
@@ -22,27 +23,40 @@ public:
     virtual bool hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_medium_tests);
+        double t;
+        return scatter_distance(r, t_min, t_max, t, false);
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         return boundary->bounding_box(time0, time1, output_box);
     }
 
+    virtual void finalize(double time0, double time1, build_report &report) override {
+        boundary = collapse_transforms(boundary, report);
+        boundary->finalize(time0, time1, report);
+    }
+
 public:
     shared_ptr<hittable> boundary;
     shared_ptr<material> phase_function;
     double neg_inv_density;
-};
 
-bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    // Print occasional samples when debugging. To enable, set enableDebug true.
-    const bool enableDebug = false;
-    const bool debugging = enableDebug && random_double() < 0.00001;
+private:
+    // Distance t within [t_min, t_max] at which the ray scatters inside the medium, if it does.
+    bool scatter_distance(const ray &r, double t_min, double t_max, double &t, bool debugging) const;
+};
 
+inline bool constant_medium::scatter_distance(const ray &r, double t_min, double t_max, double &t,
+                                              bool debugging) const {
     hit_record rec1, rec2;
 
-    if (!boundary->hit(r, -infinity, infinity, rec1))
+    // Only the distances are needed, so the boundary hits are not finished.
+    if (!boundary->find_hit(r, -infinity, infinity, rec1))
         return false;
 
-    if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
+    if (!boundary->find_hit(r, rec1.t + 0.0001, infinity, rec2))
         return false;
 
     if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
@@ -58,23 +72,35 @@ bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &
 
     const auto ray_length = r.direction().length();
     const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
+    // hit() gets no sampler, so the free path is drawn from a generator seeded with the ray.
+    auto rng = sampler::for_ray(r.origin().e, r.direction().e);
+    const auto hit_distance = neg_inv_density * log(1.0 - rng.next_double());
 
     if (hit_distance > distance_inside_boundary)
         return false;
 
-    rec.t = rec1.t + hit_distance / ray_length;
+    t = rec1.t + hit_distance / ray_length;
+    return true;
+}
+
+bool constant_medium::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_medium_tests);
+    // Print occasional samples when debugging. To enable, set enableDebug true.
+    const bool enableDebug = false;
+    const bool debugging = enableDebug && sampler::for_ray(r.origin().e, r.direction().e).next_double() < 0.00001;
+
+    if (!scatter_distance(r, t_min, t_max, rec.t, debugging))
+        return false;
     rec.p = r.at(rec.t);
 
     if (debugging) {
-        std::cerr << "hit_distance = " << hit_distance << '\n'
-                  << "rec.t = " << rec.t << '\n'
+        std::cerr << "rec.t = " << rec.t << '\n'
                   << "rec.p = " << rec.p << '\n';
     }
 
     rec.normal = vec3(1, 0, 0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
 
     return true;
 }
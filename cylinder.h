@@ -13,6 +13,12 @@ public:
 
     virtual bool hit(const ray& r, double tmin, double tmax, hit_record& rec) const override;
 
+    virtual bool find_hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+    virtual void finish_hit(const ray& r, hit_record& rec) const override;
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 public:
@@ -20,6 +26,10 @@ public:
     point3 cap;
     double radius;
     shared_ptr<material> mat_ptr;
+
+private:
+    // Nearest intersection with the side within [t_min, t_max].
+    bool find_root(const ray& r, double t_min, double t_max, double& root) const;
 };
 
 inline void get_cylinder_uv(const vec3& p, double& u, double& v) {
@@ -28,7 +38,7 @@ inline void get_cylinder_uv(const vec3& p, double& u, double& v) {
     v = p.y();
 }
 
-bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool cylinder::find_root(const ray& r, double t_min, double t_max, double& root) const {
     vec3 oc = r.origin() - base;
     vec3 direction = r.direction();
 
@@ -40,7 +50,7 @@ bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     if (discriminant < 0) return false;
 
     auto sqrtd = sqrt(discriminant);
-    auto root = (-b - sqrtd) / (2 * a);
+    root = (-b - sqrtd) / (2 * a);
 
     if (root < t_min || t_max < root) {
         root = (-b + sqrtd) / (2 * a);
@@ -48,18 +58,40 @@ bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
             return false;
     }
 
-    vec3 hit_point = r.at(root);
-    double hit_y = hit_point.y();
-    if (hit_y < base.y() || hit_y > cap.y()) return false;
+    double hit_y = r.at(root).y();
+    return hit_y >= base.y() && hit_y <= cap.y();
+}
+
+bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool cylinder::find_hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    TRACERGEN_COUNT(stat_cylinder_tests);
+    double root;
+    if (!find_root(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
-    rec.p = hit_point;
+    rec.object = this;
+    return true;
+}
+
+void cylinder::finish_hit(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - base) / radius;
     rec.set_face_normal(r, outward_normal);
     get_cylinder_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+bool cylinder::occluded(const ray& r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_cylinder_tests);
+    double root;
+    return find_root(r, t_min, t_max, root);
 }
 
 bool cylinder::bounding_box(double time0, double time1, aabb& output_box) const {
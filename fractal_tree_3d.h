@@ -9,6 +9,7 @@
 #include "hittable_list.h"
 #include "cylinder.h"
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
 #include <cmath>
@@ -21,7 +22,22 @@ public:
     FractalTree3D(const point3& root, double initial_length, double initial_radius, int iterations, shared_ptr<material> mat);
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool find_hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return tree_parts.find_hit(r, t_min, t_max, rec);
+    }
+    virtual void hit_packet(ray_packet& packet, uint32_t active, double t_min) const override {
+        tree_parts.hit_packet(packet, active, t_min);
+    }
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return tree_parts.occluded(r, t_min, t_max);
+    }
+    virtual uint32_t occluded_packet(ray_packet& packet, uint32_t active, double t_min) const override {
+        return tree_parts.occluded_packet(packet, active, t_min);
+    }
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const override;
+    virtual void finalize(double t0, double t1, build_report& report) override {
+        tree_parts.finalize(t0, t1, report);
+    }
 
 private:
     hittable_list tree_parts;
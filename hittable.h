@@ -6,16 +6,38 @@
 #include "utility.h"
 #include "aabb.h"
 
+#include <unordered_set>
+
 class material;
+class hittable;
+
+// What finalize() built, reported once the scene is ready to render.
+struct build_report {
+    int bvh_count = 0;
+    size_t primitive_count = 0;
+    int collapsed_transforms = 0;
+    // Objects shared between instances, so that each is finalized (and counted) once.
+    std::unordered_set<const hittable *> shared_objects;
+
+    // True the first time object is seen.
+    bool first_visit(const hittable *object) {
+        return shared_objects.insert(object).second;
+    }
+};
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    // Non-owning: the primitive that was hit keeps its material alive for the whole render.
+    const material *mat_ptr;
     double t;
     double u;
     double v;
     bool front_face;
+    // Set by find_hit(): the primitive whose finish_hit() computes the other fields, and
+    // which of its parts was hit. Primitives with barycentrics keep them in u and v.
+    const hittable *object;
+    int primitive;
 
     inline void set_face_normal(const ray &r, const vec3 &outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
@@ -23,13 +45,108 @@ struct hit_record {
     }
 };
 
+// Rays traced together by hittable::hit_packet. Every ray has its own t_max, lowered to the
+// distance of its closest hit so far; recs holds that hit, as left by find_hit(), and bit i
+// of hits is set once ray i hit something.
+struct ray_packet {
+    static constexpr int max_size = 16;
+
+    ray rays[max_size];
+    double t_max[max_size];
+    hit_record recs[max_size];
+    uint32_t hits = 0;
+    int size = 0;
+
+    void clear() {
+        size = 0;
+        hits = 0;
+    }
+
+    void add(const ray &r, double ray_t_max) {
+        rays[size] = r;
+        t_max[size] = ray_t_max;
+        size++;
+    }
+
+    uint32_t all() const { return (1u << size) - 1; }
+};
+
 class hittable {
 public:
     virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const = 0;
 
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const = 0;
+
+    // hit() in two steps, so that traversal does not pay for the attributes of hits that a
+    // closer one replaces. find_hit() only sets t, object, primitive and, where the
+    // intersection test yields them, u and v; rec.object->finish_hit() then computes the
+    // point, normal, uv and material of the final hit. Composites forward find_hit() to
+    // their parts. The default is hit() itself, leaving nothing to finish.
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+        if (!hit(r, t_min, t_max, rec))
+            return false;
+        rec.object = this;
+        return true;
+    }
+
+    virtual void finish_hit(const ray &r, hit_record &rec) const {}
+
+    // Packet version of find_hit() for the rays of packet selected by the active mask. The
+    // default traces them one at a time; BVHs override it to share node fetches.
+    virtual void hit_packet(ray_packet &packet, uint32_t active, double t_min) const;
+
+    // True if anything lies on the ray between t_min and t_max. Shadow rays need no more
+    // than that, so implementations stop at the first intersection they find and fill no
+    // hit record. The default falls back on hit().
+    virtual bool occluded(const ray &r, double t_min, double t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
+
+    // Packet version of occluded(): returns the mask of the active rays that are blocked.
+    // The t_max of a blocked ray may be lowered.
+    virtual uint32_t occluded_packet(ray_packet &packet, uint32_t active, double t_min) const;
+
+    // Scene finalization, run once before rendering: composite hittables build an
+    // acceleration structure over their parts.
+    virtual void finalize(double time0, double time1, build_report &report) {}
+
+    // Solid angle density with which random() picks direction v from origin o. Only
+    // the shapes that can be used as light sources implement it.
+    virtual double pdf_value(const point3 &o, const vec3 &v) const {
+        return 0.0;
+    }
+
+    // Random direction from o towards a point on the surface.
+    virtual vec3 random(const point3 &o, sampler &rng) const {
+        return vec3(1, 0, 0);
+    }
 };
 
+inline void hittable::hit_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    hit_record rec;
+    while (active) {
+        int i = __builtin_ctz(active);
+        active &= active - 1;
+        if (find_hit(packet.rays[i], t_min, packet.t_max[i], rec)) {
+            packet.t_max[i] = rec.t;
+            packet.recs[i] = rec;
+            packet.hits |= 1u << i;
+        }
+    }
+}
+
+inline uint32_t hittable::occluded_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    uint32_t blocked = 0;
+    while (active) {
+        int i = __builtin_ctz(active);
+        active &= active - 1;
+        if (occluded(packet.rays[i], t_min, packet.t_max[i]))
+            blocked |= 1u << i;
+    }
+    return blocked;
+}
+
 class translate : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3 &displacement)
@@ -38,14 +155,24 @@ public:
     virtual bool hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_instance_tests);
+        return ptr->occluded(ray(r.origin() - offset, r.direction(), r.time()), t_min, t_max);
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override;
 
+    virtual void finalize(double time0, double time1, build_report &report) override {
+        ptr->finalize(time0, time1, report);
+    }
+
 public:
     shared_ptr<hittable> ptr;
     vec3 offset;
 };
 
 inline bool translate::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_instance_tests);
     ray moved_r(r.origin() - offset, r.direction(), r.time());
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
@@ -74,17 +201,40 @@ public:
     virtual bool hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_instance_tests);
+        return ptr->occluded(to_object(r), t_min, t_max);
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
         output_box = bbox;
         return hasbox;
     }
 
+    virtual void finalize(double time0, double time1, build_report &report) override {
+        ptr->finalize(time0, time1, report);
+    }
+
 public:
     shared_ptr<hittable> ptr;
     double sin_theta;
     double cos_theta;
     bool hasbox;
     aabb bbox;
+
+private:
+    ray to_object(const ray &r) const {
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
 
 inline rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
@@ -120,16 +270,8 @@ inline rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
 }
 
 inline bool rotate_y::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-    ray rotated_r(origin, direction, r.time());
+    TRACERGEN_COUNT(stat_instance_tests);
+    ray rotated_r = to_object(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
@@ -23,22 +23,62 @@ public:
     void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
     virtual bool hit(
+            const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        if (!find_hit(r, t_min, t_max, rec))
+            return false;
+        rec.object->finish_hit(r, rec);
+        return true;
+    }
+
+    virtual bool find_hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
     virtual bool bounding_box(
             double time0, double time1, aabb &output_box) const override;
 
+    virtual void hit_packet(ray_packet &packet, uint32_t active, double t_min) const override {
+        for (const auto &object: objects)
+            object->hit_packet(packet, active, t_min);
+    }
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        for (const auto &object: objects) {
+            if (object->occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+    }
+
+    virtual uint32_t occluded_packet(ray_packet &packet, uint32_t active, double t_min) const override {
+        uint32_t blocked = 0;
+        for (const auto &object: objects) {
+            if (blocked == active)
+                break;
+            blocked |= object->occluded_packet(packet, active & ~blocked, t_min);
+        }
+        return blocked;
+    }
+
+    // Finalizes every object, then replaces the objects by a single bvh_node when there are
+    // more than a BVH leaf holds. Defined in bvh.cpp.
+    virtual void finalize(double time0, double time1, build_report &report) override;
+
+    // Mixture of the objects' densities, each picked with equal probability.
+    virtual double pdf_value(const point3 &o, const vec3 &v) const override;
+
+    virtual vec3 random(const point3 &o, sampler &rng) const override;
+
 public:
     std::vector<shared_ptr<hittable>> objects;
 };
 
-inline bool hittable_list::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+inline bool hittable_list::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
     hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
     for (const auto &object: objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->find_hit(r, t_min, closest_so_far, temp_rec)) {
             hit_anything = true;
             closest_so_far = temp_rec.t;
             rec = temp_rec;
@@ -63,5 +103,19 @@ inline bool hittable_list::bounding_box(double time0, double time1, aabb &output
     return true;
 }
 
+inline double hittable_list::pdf_value(const point3 &o, const vec3 &v) const {
+    if (objects.empty()) return 0.0;
+
+    auto sum = 0.0;
+    for (const auto &object: objects)
+        sum += object->pdf_value(o, v);
+
+    return sum / objects.size();
+}
+
+inline vec3 hittable_list::random(const point3 &o, sampler &rng) const {
+    auto index = static_cast<size_t>(rng.next_double() * objects.size());
+    return objects[index]->random(o, rng);
+}
 
 #endif //TRACERGEN_HITTABLE_LIST_H
\ No newline at end of file
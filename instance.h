@@ -0,0 +1,255 @@
+#ifndef TRACERGEN_INSTANCE_H
+#define TRACERGEN_INSTANCE_H
+
+#include "utility.h"
+
+#include "hittable.h"
+
+// Affine map stored as a 3x4 matrix: a 3x3 linear part and a translation column.
+class affine_transform {
+public:
+    affine_transform() {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = i == j ? 1 : 0;
+    }
+
+    static affine_transform translation(const vec3 &offset) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    static affine_transform scaling(double s) {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = s;
+        return t;
+    }
+
+    // Same convention as rotate_y: a positive angle turns +z towards +x.
+    static affine_transform rotation_y(double angle) {
+        auto radians = degrees_to_radians(angle);
+        return rotation_y(sin(radians), cos(radians));
+    }
+
+    static affine_transform rotation_y(double sin_theta, double cos_theta) {
+        affine_transform t;
+        t.m[0][0] = cos_theta;
+        t.m[0][2] = sin_theta;
+        t.m[2][0] = -sin_theta;
+        t.m[2][2] = cos_theta;
+        return t;
+    }
+
+    point3 point(const point3 &p) const {
+        return vector(p) + vec3(m[0][3], m[1][3], m[2][3]);
+    }
+
+    vec3 vector(const vec3 &v) const {
+        return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    affine_transform inverse() const {
+        affine_transform inv;
+        // Adjugate of the linear part divided by its determinant.
+        inv.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        inv.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        inv.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        inv.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        inv.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        inv.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        inv.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        inv.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        inv.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        auto det = m[0][0] * inv.m[0][0] + m[0][1] * inv.m[1][0] + m[0][2] * inv.m[2][0];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                inv.m[i][j] /= det;
+
+        vec3 offset = -inv.vector(vec3(m[0][3], m[1][3], m[2][3]));
+        for (int i = 0; i < 3; i++)
+            inv.m[i][3] = offset[i];
+        return inv;
+    }
+
+public:
+    double m[3][4];
+};
+
+// Applies b first, then a.
+inline affine_transform operator*(const affine_transform &a, const affine_transform &b) {
+    affine_transform c;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            c.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        c.m[i][3] += a.m[i][3];
+    }
+    return c;
+}
+
+// Places a shared object in the scene with an affine transform. The object (and its
+// BVH) is built once and can be referenced by any number of instances, so the top-level
+// BVH only holds these small wrappers.
+class transform_instance : public hittable {
+public:
+    transform_instance(shared_ptr<hittable> p, const affine_transform &object_to_world);
+
+    virtual bool hit(
+            const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_instance_tests);
+        return ptr->occluded(object_ray(r), t_min, t_max);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
+        output_box = bbox;
+        return hasbox;
+    }
+
+    // The object is shared, so only the first instance to reach it finalizes it.
+    virtual void finalize(double time0, double time1, build_report &report) override {
+        if (report.first_visit(ptr.get()))
+            ptr->finalize(time0, time1, report);
+    }
+
+public:
+    shared_ptr<hittable> ptr;
+    affine_transform to_world;
+    affine_transform to_object;
+    // Inverse transpose of the linear part, divided by the scale when conformal is set.
+    affine_transform normal_to_world;
+    // True when the linear part is a rotation times a uniform scale.
+    bool conformal;
+    bool hasbox;
+    aabb bbox;
+
+private:
+    // The ray in object space. The direction is not normalized, so t is the same in both
+    // spaces. Scales and translations, the common case, skip the off-diagonal terms.
+    ray object_ray(const ray &r) const {
+        if (!diagonal)
+            return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+        const auto &m = to_object.m;
+        vec3 scale(m[0][0], m[1][1], m[2][2]);
+        return ray(scale * r.origin() + vec3(m[0][3], m[1][3], m[2][3]), scale * r.direction(), r.time());
+    }
+
+    // True when the linear part has no off-diagonal terms.
+    bool diagonal;
+};
+
+inline transform_instance::transform_instance(shared_ptr<hittable> p, const affine_transform &object_to_world)
+        : ptr(p), to_world(object_to_world), to_object(object_to_world.inverse()) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            normal_to_world.m[i][j] = to_object.m[j][i];
+        normal_to_world.m[i][3] = 0;
+    }
+
+    // Conformal when the columns of the linear part are orthogonal and of equal length.
+    vec3 columns[3];
+    for (int j = 0; j < 3; j++)
+        columns[j] = vec3(to_world.m[0][j], to_world.m[1][j], to_world.m[2][j]);
+    auto scale_squared = columns[0].length_squared();
+    auto tolerance = 1e-9 * scale_squared;
+    conformal = fabs(columns[1].length_squared() - scale_squared) <= tolerance
+                && fabs(columns[2].length_squared() - scale_squared) <= tolerance
+                && fabs(dot(columns[0], columns[1])) <= tolerance
+                && fabs(dot(columns[0], columns[2])) <= tolerance
+                && fabs(dot(columns[1], columns[2])) <= tolerance;
+    diagonal = true;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            diagonal = diagonal && (i == j || to_object.m[i][j] == 0);
+
+    if (conformal) {
+        auto scale = sqrt(scale_squared);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                normal_to_world.m[i][j] *= scale;
+    }
+
+    aabb object_box;
+    hasbox = ptr->bounding_box(0, 1, object_box);
+
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                auto x = i * object_box.max().x() + (1 - i) * object_box.min().x();
+                auto y = j * object_box.max().y() + (1 - j) * object_box.min().y();
+                auto z = k * object_box.max().z() + (1 - k) * object_box.min().z();
+
+                auto tester = to_world.point(point3(x, y, z));
+
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], tester[c]);
+                    max[c] = fmax(max[c], tester[c]);
+                }
+            }
+        }
+    }
+
+    bbox = aabb(min, max);
+}
+
+inline bool transform_instance::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_instance_tests);
+    if (!ptr->hit(object_ray(r), t_min, t_max, rec))
+        return false;
+
+    // Normals transform with the inverse transpose, which keeps their side of the ray. For
+    // rotations, translations and uniform scales that is the rotation alone, which keeps
+    // the normal's length too; other maps rescale it to the length the object returned.
+    rec.p = to_world.point(rec.p);
+    if (conformal) {
+        rec.normal = normal_to_world.vector(rec.normal);
+    } else {
+        auto length = rec.normal.length();
+        rec.normal = length * unit_vector(normal_to_world.vector(rec.normal));
+    }
+
+    return true;
+}
+
+// Collapses a chain of translate, rotate_y and transform_instance wrappers into a single
+// transform_instance, so the ray is transformed once instead of once per wrapper. Anything
+// that is not a chain of at least two wrappers is returned unchanged.
+inline shared_ptr<hittable> collapse_transforms(const shared_ptr<hittable> &object, build_report &report) {
+    affine_transform to_world;
+    shared_ptr<hittable> inner = object;
+    int wrappers = 0;
+
+    while (true) {
+        if (auto t = std::dynamic_pointer_cast<translate>(inner)) {
+            to_world = to_world * affine_transform::translation(t->offset);
+            inner = t->ptr;
+        } else if (auto r = std::dynamic_pointer_cast<rotate_y>(inner)) {
+            to_world = to_world * affine_transform::rotation_y(r->sin_theta, r->cos_theta);
+            inner = r->ptr;
+        } else if (auto i = std::dynamic_pointer_cast<transform_instance>(inner)) {
+            to_world = to_world * i->to_world;
+            inner = i->ptr;
+        } else {
+            break;
+        }
+        wrappers++;
+    }
+
+    if (wrappers < 2)
+        return object;
+
+    report.collapsed_transforms++;
+    return make_shared<transform_instance>(inner, to_world);
+}
+
+#endif //TRACERGEN_INSTANCE_H
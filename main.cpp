@@ -5,6 +5,8 @@
 #include <fstream>
 #include <thread>
 #include <chrono>
+#include <condition_variable>
+#include <typeindex>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range2d.h>
 #include <tbb/tbb.h>
@@ -17,36 +19,110 @@
 #include "hittable_list.h"
 #include "camera.h"
 #include "scenes.h"
+#include "scene_file.h"
 
-struct image_settings {
-    int image_height;
-    int image_width;
-    int samples_per_pixel;
-    int max_depth;
-    color background;
-};
+// Power heuristic weight of a sample drawn with density pdf_a when pdf_b could also have produced it.
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    return pdf_a * pdf_a / (pdf_a * pdf_a + pdf_b * pdf_b);
+}
 
-auto start_time = std::chrono::high_resolution_clock::now();
+// Shadow rays stop this fraction of the way to the light, so the light itself is never
+// taken for an occluder.
+constexpr double shadow_clearance = 1 - 1e-6;
 
-color ray_color(const ray &r, const color &background, const hittable &world, int depth) {
+// Emission of the first surface in front of a sampled light, for a shadow ray that
+// occluded() found blocked. Emitters that collect_lights missed (nested in a transform or a
+// BVH) can sit in front of a sampled light; the material-sampled path weights them against
+// light sampling too, so they must not be counted as blockers. Everything else emits black.
+color blocking_emission(const hittable &world, const ray &r, double t_max) {
     hit_record rec;
+    if (!world.hit(r, 0.001, t_max, rec))
+        return color(0, 0, 0);
+    return rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+}
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
+// Next event estimation: radiance reaching rec.p through a direction picked on one of the lights.
+// The light the direction lands on gives the emission, unless the shadow ray finds something
+// in front of it.
+color sample_lights(const ray &r_in, const hit_record &rec, const color &attenuation, const hittable &world,
+                    const hittable_list &lights, sampler &rng, long &rays) {
+    ray to_light(rec.p, lights.random(rec.p, rng), r_in.time());
+    auto light_pdf = lights.pdf_value(to_light.origin(), to_light.direction());
+    if (light_pdf <= 0)
         return color(0, 0, 0);
 
-    // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+    auto scatter_pdf = rec.mat_ptr->scattering_pdf(r_in, rec, to_light);
+    if (scatter_pdf <= 0)
+        return color(0, 0, 0);
 
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    hit_record light_rec;
+    if (!lights.hit(to_light, 0.001, infinity, light_rec))
+        return color(0, 0, 0);
+
+    rays++;
+    TRACERGEN_COUNT(stat_shadow_rays);
+    auto t_max = light_rec.t * shadow_clearance;
+    color emitted = world.occluded(to_light, 0.001, t_max)
+                    ? blocking_emission(world, to_light, t_max)
+                    : light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+    return attenuation * emitted * (scatter_pdf * power_heuristic(light_pdf, scatter_pdf) / light_pdf);
+}
+
+color ray_color(const ray &r, const color &background, const hittable &world, const hittable_list &lights,
+                int max_depth, int rr_depth, sampler &rng, long &rays) {
+    hit_record rec;
+    ray current = r;
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    // Density of the material sample that produced current; 0 for camera rays and specular bounces.
+    double scatter_pdf = 0;
+
+    for (int depth = 0; depth < max_depth; ++depth) {
+        // If the ray hits nothing, gather the background color.
+        rays++;
+        TRACERGEN_COUNT(depth == 0 ? stat_camera_rays : stat_secondary_rays);
+        TRACERGEN_COUNT(stat_path_segments);
+        if (!world.hit(current, 0.001, infinity, rec)) {
+            TRACERGEN_COUNT(stat_paths_escaped);
+            return radiance + throughput * background;
+        }
+
+        ray scattered;
+        color attenuation;
+        color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+        // This emitter could also have been reached by light sampling at the previous bounce.
+        if (scatter_pdf > 0 && !lights.objects.empty())
+            emitted *= power_heuristic(scatter_pdf, lights.pdf_value(current.origin(), current.direction()));
+        radiance += throughput * emitted;
+
+        if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered, rng)) {
+            TRACERGEN_COUNT(stat_paths_absorbed);
+            return radiance;
+        }
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+        scatter_pdf = rec.mat_ptr->scattering_pdf(current, rec, scattered);
+        if (scatter_pdf > 0 && !lights.objects.empty())
+            radiance += throughput * sample_lights(current, rec, attenuation, world, lights, rng, rays);
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+        throughput = throughput * attenuation;
+        current = scattered;
+
+        // Russian roulette: past rr_depth, end paths with a probability that grows as their
+        // throughput drops, and scale the survivors so the estimate stays unbiased.
+        if (depth + 1 >= rr_depth) {
+            auto survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+            if (rng.next_double() >= survive) {
+                TRACERGEN_COUNT(stat_paths_russian_roulette);
+                return radiance;
+            }
+            throughput /= survive;
+        }
+    }
+
+    // We've exceeded the ray bounce limit, no more light is gathered.
+    TRACERGEN_COUNT(stat_paths_max_depth);
+    return radiance;
 }
 
 
@@ -66,12 +142,11 @@ void print_formatted_time(std::ostream& os, int seconds) {
     os << seconds << "s";
 }
 
-void print_progress(double progress, const std::chrono::high_resolution_clock::time_point &start_time, int total_pixels, int image_width, int image_height) {
+void print_progress(double progress, double elapsed_time, long pixels, long total_pixels,
+                    double samples_per_second, double rays_per_second) {
     int bar_width = 50;
 
-    auto current_time = std::chrono::high_resolution_clock::now();
-    auto elapsed_time = std::chrono::duration<double>(current_time - start_time).count();
-    auto estimated_remaining_time = elapsed_time * (1.0 - progress) / progress;
+    auto estimated_remaining_time = progress > 0 ? elapsed_time * (1.0 - progress) / progress : 0.0;
 
     std::cout << "[";
     int pos = static_cast<int>(bar_width * progress);
@@ -81,179 +156,668 @@ void print_progress(double progress, const std::chrono::high_resolution_clock::t
         else std::cout << " ";
     }
     std::cout << "] " << static_cast<int>(progress * 100.0) << " %"
-              << " (" << total_pixels << " of " << image_height * image_width << " pixels)"
+              << " (" << pixels << " of " << total_pixels << " pixels)"
               << " Elapsed: ";
     print_formatted_time(std::cout, static_cast<int>(elapsed_time));
     std::cout << " Remaining: ";
     print_formatted_time(std::cout, static_cast<int>(estimated_remaining_time));
+    std::cout << " " << static_cast<long>(samples_per_second / 1000) << "k samples/s "
+              << static_cast<long>(rays_per_second / 1000) << "k rays/s";
     std::cout << "    \r";
     std::cout.flush();
 }
 
+// Counters shared by the tile workers and the progress reporter. Workers add their totals
+// once per tile with relaxed atomics; the reporter only needs approximate values.
+struct render_progress {
+    std::atomic<long> pixels{0};
+    std::atomic<long> samples{0};
+    std::atomic<long> rays{0};
+};
+
+// Reports progress from its own thread at a fixed interval, so workers never take a lock or
+// touch the terminal. With a machine_output stream, every report is also written there as
+// one JSON object per line.
+class progress_reporter {
+public:
+    progress_reporter(const render_progress &render_counters, long image_pixels, double interval_seconds,
+                      std::ostream *machine_stream)
+            : counters(render_counters), total_pixels(image_pixels), interval(interval_seconds),
+              machine_output(machine_stream), start_time(std::chrono::steady_clock::now()),
+              thread([this] { run(); }) {}
+
+    ~progress_reporter() { stop(); }
+
+    // Wakes the reporter for a last, complete report and joins it.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        wake.notify_one();
+        if (thread.joinable())
+            thread.join();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, std::chrono::duration<double>(interval), [this] { return done; }))
+            report(false);
+        report(true);
+    }
+
+    void report(bool finished) {
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        long pixels = counters.pixels.load(std::memory_order_relaxed);
+        long samples = counters.samples.load(std::memory_order_relaxed);
+        long rays = counters.rays.load(std::memory_order_relaxed);
+        double progress = static_cast<double>(pixels) / total_pixels;
+        double samples_per_second = elapsed > 0 ? samples / elapsed : 0.0;
+        double rays_per_second = elapsed > 0 ? rays / elapsed : 0.0;
+
+        print_progress(progress, elapsed, pixels, total_pixels, samples_per_second, rays_per_second);
+
+        if (machine_output) {
+            *machine_output << "{\"pixels\":" << pixels << ",\"total_pixels\":" << total_pixels
+                            << ",\"progress\":" << progress << ",\"elapsed\":" << elapsed
+                            << ",\"samples\":" << samples << ",\"rays\":" << rays
+                            << ",\"samples_per_second\":" << samples_per_second
+                            << ",\"rays_per_second\":" << rays_per_second
+                            << ",\"done\":" << (finished ? "true" : "false") << "}\n";
+            machine_output->flush();
+        }
+    }
 
-std::mutex progress_mutex;
+    const render_progress &counters;
+    long total_pixels;
+    double interval;
+    std::ostream *machine_output;
+    std::chrono::steady_clock::time_point start_time;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool done = false;
+    std::thread thread; // last, so it starts once everything else is initialized
+};
+
+// Adaptive stopping test on a pixel's luminance statistics after s samples. A pixel whose
+// samples were all black has no error estimate worth trusting (a small light may simply
+// not have been found yet), so it only stops once it has seen some light.
+inline bool pixel_converged(const image_settings &settings, int s, double mean, double m2) {
+    if (settings.adaptive_threshold <= 0 || s < 2 || mean <= 0)
+        return false;
+    auto standard_error = sqrt(m2 / ((s - 1.0) * s));
+    return standard_error <= settings.adaptive_threshold * mean;
+}
 
 void render_tile(const tbb::blocked_range2d<int>& tile_range, struct image_settings &settings, const std::shared_ptr<std::vector<color>> &image,
-                 camera &cam, hittable_list &world, std::atomic<int> &lines_rendered) {
+                 camera &cam, hittable_list &world, const hittable_list &lights, render_progress &progress) {
+    long tile_samples = 0;
+    long tile_rays = 0;
     for (int j = tile_range.rows().begin(); j != tile_range.rows().end(); ++j) {
         for (int i = tile_range.cols().begin(); i != tile_range.cols().end(); ++i) {
             color pixel_color(0, 0, 0);
-            for (int s = 0; s < settings.samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (settings.image_width - 1);
-                auto v = (j + random_double()) / (settings.image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, settings.background, world, settings.max_depth);
+            double mean = 0;
+            double m2 = 0;
+            int s = 0;
+            while (s < settings.samples_per_pixel) {
+                int round_end = settings.adaptive_threshold > 0
+                                ? std::min(s + settings.adaptive_min_samples, settings.samples_per_pixel)
+                                : settings.samples_per_pixel;
+                for (; s < round_end; ++s) {
+                    // Seeded per pixel and sample: the image does not depend on the thread count.
+                    auto rng = sampler::for_pixel(static_cast<size_t>(j) * settings.image_width + i, s);
+                    auto u = (i + rng.next_double()) / (settings.image_width - 1);
+                    auto v = (j + rng.next_double()) / (settings.image_height - 1);
+                    ray r = cam.get_ray(u, v, rng);
+                    color sample = ray_color(r, settings.background, world, lights, settings.max_depth, settings.rr_depth, rng,
+                                             tile_rays);
+                    pixel_color += sample;
+
+                    // Welford update of the luminance mean and sum of squared deviations.
+                    auto luminance = 0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z();
+                    auto delta = luminance - mean;
+                    mean += delta / (s + 1);
+                    m2 += delta * (luminance - mean);
+                }
+
+                if (pixel_converged(settings, s, mean, m2))
+                    break;
             }
-            (*image)[j * settings.image_width + i] = pixel_color;
+            pixel_color /= s;
+            tile_samples += s;
+            (*image)[static_cast<size_t>(j) * settings.image_width + i] = pixel_color;
         }
     }
 
     int pixels_rendered_in_tile = (tile_range.rows().end() - tile_range.rows().begin()) * (tile_range.cols().end() - tile_range.cols().begin());
 
-    {
-        std::lock_guard<std::mutex> lock(progress_mutex);
-        lines_rendered += pixels_rendered_in_tile;
-        double progress = static_cast<double>(lines_rendered) / (settings.image_height * settings.image_width);
-        print_progress(progress, start_time, lines_rendered, settings.image_width, settings.image_height);
+    progress.pixels.fetch_add(pixels_rendered_in_tile, std::memory_order_relaxed);
+    progress.samples.fetch_add(tile_samples, std::memory_order_relaxed);
+    progress.rays.fetch_add(tile_rays, std::memory_order_relaxed);
+}
+
+
+
+// Paths of one wavefront tile, stored structure-of-arrays. A path is one camera sample;
+// it keeps its own sampler, so it draws the same numbers as ray_color would.
+struct wavefront_paths {
+    std::vector<ray> rays;
+    std::vector<hit_record> hits;
+    std::vector<color> throughput;
+    std::vector<color> radiance;
+    std::vector<double> scatter_pdf;
+    std::vector<sampler> rngs;
+    std::vector<int> pixel; // index into the tile's pixel list
+
+    void clear() {
+        rays.clear();
+        hits.clear();
+        throughput.clear();
+        radiance.clear();
+        scatter_pdf.clear();
+        rngs.clear();
+        pixel.clear();
+    }
+
+    int add(const ray &r, const sampler &rng, int pixel_index) {
+        rays.push_back(r);
+        hits.emplace_back();
+        throughput.emplace_back(1, 1, 1);
+        radiance.emplace_back(0, 0, 0);
+        scatter_pdf.push_back(0);
+        rngs.push_back(rng);
+        pixel.push_back(pixel_index);
+        return static_cast<int>(rays.size() - 1);
+    }
+};
+
+// Light sample waiting for its visibility test: the radiance it adds to the path if nothing
+// lies on r before t_max.
+struct shadow_query {
+    int path;
+    ray r;
+    double t_max;
+    color throughput;
+    color attenuation;
+    double weight;  // BSDF and MIS weight of the light sample
+    color emitted;  // of the sampled light, credited if nothing blocks it
+};
+
+// Orders secondary rays for coherent traversal: by direction octant first, then along a
+// Morton curve over their origins inside the scene bounds, so rays that start close
+// together and head the same way are traced one after another and reuse the BVH nodes
+// already in cache.
+class ray_binner {
+public:
+    explicit ray_binner(const aabb &scene_bounds) : lo(scene_bounds.min()) {
+        vec3 extent = scene_bounds.max() - scene_bounds.min();
+        for (int a = 0; a < 3; a++)
+            scale[a] = extent[a] > 0 ? 1023.0 / extent[a] : 0.0;
+    }
+
+    uint64_t key(const ray &r) const {
+        const vec3 &d = r.direction();
+        uint64_t octant = (d.x() < 0) | (d.y() < 0) << 1 | (d.z() < 0) << 2;
+
+        uint64_t morton = 0;
+        for (int a = 0; a < 3; a++) {
+            auto cell = static_cast<uint32_t>(clamp((r.origin()[a] - lo[a]) * scale[a], 0.0, 1023.0));
+            morton |= static_cast<uint64_t>(spread_bits(cell)) << a;
+        }
+        return octant << 30 | morton;
+    }
+
+    void sort(std::vector<int> &queue, const std::vector<ray> &rays,
+              std::vector<std::pair<uint64_t, int>> &scratch) const {
+        scratch.clear();
+        for (int p: queue)
+            scratch.emplace_back(key(rays[p]), p);
+        std::sort(scratch.begin(), scratch.end());
+        for (size_t i = 0; i < queue.size(); i++)
+            queue[i] = scratch[i].second;
+    }
+
+private:
+    // Moves the low 10 bits of x to every third bit.
+    static uint32_t spread_bits(uint32_t x) {
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
+
+    point3 lo;
+    vec3 scale;
+};
+
+// Optional parts of the wavefront stages.
+struct wavefront_options {
+    const ray_binner *binner = nullptr; // sorts the secondary rays before every extend stage
+    int packet_size = 0;                // camera rays and their shadow rays traced in packets, 0 = one by one
+};
+
+// Closest hits of rays [0, count) given by get_ray(k), traced in packets of packet_size.
+// Calls result(k, rec) in order of k, with rec null if ray k hit nothing.
+template <typename RayFn, typename ResultFn>
+void trace_packets(const hittable &world, size_t count, int packet_size, RayFn &&get_ray, ResultFn &&result) {
+    ray_packet packet;
+    for (size_t first = 0; first < count; first += packet_size) {
+        packet.clear();
+        for (size_t k = first; k < count && packet.size < packet_size; k++)
+            packet.add(get_ray(k), infinity);
+        world.hit_packet(packet, packet.all(), 0.001);
+        for (int i = 0; i < packet.size; i++) {
+            bool hit = packet.hits >> i & 1;
+            if (hit)
+                packet.recs[i].object->finish_hit(packet.rays[i], packet.recs[i]);
+            result(first + i, hit ? &packet.recs[i] : nullptr);
+        }
+    }
+}
+
+// Runs every path of paths to completion, one bounce per iteration, with each stage a
+// separate loop over a queue: extend (closest hit for all active paths), shade (grouped by
+// material type so each material's code runs over a batch of hits) and shadow (visibility
+// of the light samples taken during shading). Per path, the same operations happen in the
+// same order as in ray_color, so the result is identical.
+void trace_wavefront(wavefront_paths &paths, const color &background, const hittable &world,
+                     const hittable_list &lights, int max_depth, int rr_depth, const wavefront_options &wave,
+                     long &rays) {
+    std::vector<int> active(paths.rays.size());
+    for (size_t i = 0; i < active.size(); i++)
+        active[i] = static_cast<int>(i);
+
+    std::vector<int> hit_queue;
+    std::vector<int> next;
+    std::vector<shadow_query> shadow_queue;
+    std::vector<std::pair<std::type_index, int>> by_material;
+    std::vector<std::pair<uint64_t, int>> sort_scratch;
+
+    for (int depth = 0; depth < max_depth && !active.empty(); ++depth) {
+        // Camera rays are generated in pixel order and are coherent already.
+        if (wave.binner && depth > 0)
+            wave.binner->sort(active, paths.rays, sort_scratch);
+        // Packets only pay off for rays as coherent as the camera rays of neighbouring pixels.
+        bool use_packets = wave.packet_size > 0 && depth == 0;
+
+        // Extend. The hit record is in paths.hits[p] when hit is true.
+        hit_queue.clear();
+        auto extend = [&](int p, bool hit) {
+            rays++;
+            TRACERGEN_COUNT(depth == 0 ? stat_camera_rays : stat_secondary_rays);
+            TRACERGEN_COUNT(stat_path_segments);
+            if (hit) {
+                hit_queue.push_back(p);
+            } else {
+                TRACERGEN_COUNT(stat_paths_escaped);
+                paths.radiance[p] = paths.radiance[p] + paths.throughput[p] * background;
+            }
+        };
+        if (use_packets) {
+            trace_packets(world, active.size(), wave.packet_size,
+                          [&](size_t k) { return paths.rays[active[k]]; },
+                          [&](size_t k, const hit_record *rec) {
+                              if (rec)
+                                  paths.hits[active[k]] = *rec;
+                              extend(active[k], rec != nullptr);
+                          });
+        } else {
+            for (int p: active)
+                extend(p, world.hit(paths.rays[p], 0.001, infinity, paths.hits[p]));
+        }
+
+        // Groups equal types together. type_index orders by type_info::before(), which unlike
+        // type_info addresses is well defined (equal types may have distinct type_infos).
+        by_material.clear();
+        for (int p: hit_queue)
+            by_material.emplace_back(typeid(*paths.hits[p].mat_ptr), p);
+        std::sort(by_material.begin(), by_material.end());
+
+        // Shade.
+        next.clear();
+        shadow_queue.clear();
+        for (const auto &entry: by_material) {
+            int p = entry.second;
+            const ray &current = paths.rays[p];
+            const hit_record &rec = paths.hits[p];
+            sampler &rng = paths.rngs[p];
+
+            ray scattered;
+            color attenuation;
+            color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+
+            if (paths.scatter_pdf[p] > 0 && !lights.objects.empty())
+                emitted *= power_heuristic(paths.scatter_pdf[p], lights.pdf_value(current.origin(), current.direction()));
+            paths.radiance[p] += paths.throughput[p] * emitted;
+
+            if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered, rng)) {
+                TRACERGEN_COUNT(stat_paths_absorbed);
+                continue;
+            }
+
+            double scatter_pdf = rec.mat_ptr->scattering_pdf(current, rec, scattered);
+            paths.scatter_pdf[p] = scatter_pdf;
+            if (scatter_pdf > 0 && !lights.objects.empty()) {
+                // The first half of sample_lights; the visibility test waits for the shadow stage.
+                ray to_light(rec.p, lights.random(rec.p, rng), current.time());
+                auto light_pdf = lights.pdf_value(to_light.origin(), to_light.direction());
+                if (light_pdf > 0) {
+                    auto light_scatter_pdf = rec.mat_ptr->scattering_pdf(current, rec, to_light);
+                    hit_record light_rec;
+                    if (light_scatter_pdf > 0 && lights.hit(to_light, 0.001, infinity, light_rec)) {
+                        double weight = light_scatter_pdf * power_heuristic(light_pdf, light_scatter_pdf) / light_pdf;
+                        color emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+                        shadow_queue.push_back({p, to_light, light_rec.t * shadow_clearance,
+                                                paths.throughput[p], attenuation, weight, emitted});
+                    }
+                }
+            }
+
+            paths.throughput[p] = paths.throughput[p] * attenuation;
+            paths.rays[p] = scattered;
+
+            if (depth + 1 >= rr_depth) {
+                auto &throughput = paths.throughput[p];
+                auto survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+                if (rng.next_double() >= survive) {
+                    TRACERGEN_COUNT(stat_paths_russian_roulette);
+                    continue;
+                }
+                throughput /= survive;
+            }
+            next.push_back(p);
+        }
+
+        // Shadow.
+        auto shadow = [&](const shadow_query &query, bool blocked) {
+            rays++;
+            TRACERGEN_COUNT(stat_shadow_rays);
+            color emitted = blocked ? blocking_emission(world, query.r, query.t_max) : query.emitted;
+            paths.radiance[query.path] += query.throughput * (query.attenuation * emitted * query.weight);
+        };
+        if (use_packets) {
+            ray_packet packet;
+            for (size_t first = 0; first < shadow_queue.size(); first += wave.packet_size) {
+                packet.clear();
+                for (size_t k = first; k < shadow_queue.size() && packet.size < wave.packet_size; k++)
+                    packet.add(shadow_queue[k].r, shadow_queue[k].t_max);
+                uint32_t blocked = world.occluded_packet(packet, packet.all(), 0.001);
+                for (int i = 0; i < packet.size; i++)
+                    shadow(shadow_queue[first + i], blocked >> i & 1);
+            }
+        } else {
+            for (const auto &query: shadow_queue)
+                shadow(query, world.occluded(query.r, 0.001, query.t_max));
+        }
+
+        active.swap(next);
     }
+
+    for (size_t i = 0; i < active.size(); i++)
+        TRACERGEN_COUNT(stat_paths_max_depth);
 }
 
+// Wavefront variant of render_tile: every round, all unconverged pixels of the tile get
+// their next adaptive_min_samples paths generated at once and traced together by
+// trace_wavefront. Pixel statistics are then updated in sample order, exactly as in
+// render_tile.
+void render_tile_wavefront(const tbb::blocked_range2d<int>& tile_range, struct image_settings &settings,
+                           const std::shared_ptr<std::vector<color>> &image, camera &cam, hittable_list &world,
+                           const hittable_list &lights, const wavefront_options &wave, render_progress &progress) {
+    struct pixel_state {
+        int i, j;
+        int s = 0;
+        double mean = 0;
+        double m2 = 0;
+        color sum = color(0, 0, 0);
+    };
+
+    std::vector<pixel_state> pixels;
+    for (int j = tile_range.rows().begin(); j != tile_range.rows().end(); ++j)
+        for (int i = tile_range.cols().begin(); i != tile_range.cols().end(); ++i)
+            pixels.push_back({i, j});
+
+    std::vector<int> open(pixels.size());
+    for (size_t k = 0; k < open.size(); k++)
+        open[k] = static_cast<int>(k);
+
+    long tile_samples = 0;
+    long tile_rays = 0;
+    wavefront_paths paths;
+    std::vector<int> still_open;
+    int round_size = std::max(1, settings.adaptive_min_samples);
+    const size_t max_wave_paths = 1024;
+
+    while (!open.empty()) {
+        // A round is traced in waves of at most max_wave_paths, so the queues stay in cache.
+        for (size_t first = 0; first < open.size(); ) {
+            paths.clear();
+            for (; first < open.size() && paths.rays.size() < max_wave_paths; first++) {
+                int k = open[first];
+                auto &px = pixels[k];
+                int round_end = std::min(px.s + round_size, settings.samples_per_pixel);
+                for (int s = px.s; s < round_end; ++s) {
+                    auto rng = sampler::for_pixel(static_cast<size_t>(px.j) * settings.image_width + px.i, s);
+                    auto u = (px.i + rng.next_double()) / (settings.image_width - 1);
+                    auto v = (px.j + rng.next_double()) / (settings.image_height - 1);
+                    ray r = cam.get_ray(u, v, rng);
+                    paths.add(r, rng, k);
+                }
+            }
+
+            trace_wavefront(paths, settings.background, world, lights, settings.max_depth, settings.rr_depth,
+                            wave, tile_rays);
 
+            // Paths were generated pixel by pixel in sample order, so this replays render_tile's updates.
+            for (size_t p = 0; p < paths.rays.size(); p++) {
+                auto &px = pixels[paths.pixel[p]];
+                const color &sample = paths.radiance[p];
+                px.sum += sample;
 
-int main() {
-    // Image
-
-    const auto aspect_ratio = 0.5;
-
-    const int image_height = 2000;
-    const int image_width = static_cast<int>(image_height * aspect_ratio);
-    const int samples_per_pixel = 50;
-    const int max_depth = 5;
-    //const int max_thread = 8;
-
-    std::atomic<int> lines_rendered(0);
-
-    auto image = std::make_shared<std::vector<color>>(image_height * image_width);
-    std::vector<std::thread> threads;
-    color back = color(0, 0, 0);
-    struct image_settings settings = {image_height, image_width, samples_per_pixel, max_depth, back};
-
-    // World
-
-    hittable_list world;
-
-    point3 lookfrom;
-    point3 lookat;
-    auto vfov = 40.0;
-    auto aperture = 0.0;
-    color background(0, 0, 0);
-
-    switch (13) {
-
-        case 1:
-            world = random_scene();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            aperture = 0.1;
-            break;
-        case 2:
-            world = two_spheres();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
-        case 3:
-            world = two_perlin_spheres();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
-        case 4:
-            world = moon();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(13, 2, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
-        case 5:
-            world = simple_light();
-            settings.background = color(0, 0, 0);
-            lookfrom = point3(26, 3, 6);
-            lookat = point3(0, 2, 0);
-            vfov = 20.0;
-            break;
-        case 6:
-            world = cornell_box();
-            background = color(0, 0, 0);
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-        case 7:
-            world = cornell_smoke();
-            lookfrom = point3(278, 278, -800);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-        case 8:
-            world = final_scene();
-            background = color(0, 0, 0);
-            lookfrom = point3(478, 278, -600);
-            lookat = point3(278, 278, 0);
-            vfov = 40.0;
-            break;
-        default:
-        case 9:
-            world = menger_sponge();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(0, 0, 3);
-            lookat = point3(0, 0, 0);
-            vfov = 40.0;
-            break;
-        case 10:
-            world = create_fractal_tree_scene();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(3, 3, 10); // Position the camera at a slightly elevated angle and some distance away
-            lookat = point3(0, 1, 0);    // Aim the camera at the base of the first tree
-            vfov = 40.0;
-            break;
-        case 11:
-            world = create_forest();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(100, 50, 100); // Position the camera at a slightly elevated angle and some distance away
-            lookat = point3(100, 5, 50);    // Aim the camera at the base of the first tree
-            vfov = 40.0;
-            break;
-        case 12:
-            world = create_ferne();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(0, 100, 150); // Position the camera at a slightly elevated angle and some distance away
-            lookat = point3(0, 50, 0);    // Aim the camera at the base of the first tree
-            vfov = 40.0;
-            break;
-        case 13:
-            world = sierpinski();
-            settings.background = color(0.70, 0.80, 1.00);
-            lookfrom = point3(0, 0, 15);
-            lookat = point3(0, 0, 0);
-            vfov = 20.0;
-            break;
+                auto luminance = 0.2126 * sample.x() + 0.7152 * sample.y() + 0.0722 * sample.z();
+                auto delta = luminance - px.mean;
+                px.mean += delta / (px.s + 1);
+                px.m2 += delta * (luminance - px.mean);
+                px.s++;
+            }
+        }
 
+        still_open.clear();
+        for (int k: open) {
+            auto &px = pixels[k];
+            if (px.s >= settings.samples_per_pixel || pixel_converged(settings, px.s, px.mean, px.m2)) {
+                (*image)[static_cast<size_t>(px.j) * settings.image_width + px.i] = px.sum / px.s;
+                tile_samples += px.s;
+            } else {
+                still_open.push_back(k);
+            }
+        }
+        open.swap(still_open);
     }
 
-    // Camera
+    progress.pixels.fetch_add(static_cast<long>(pixels.size()), std::memory_order_relaxed);
+    progress.samples.fetch_add(tile_samples, std::memory_order_relaxed);
+    progress.rays.fetch_add(tile_rays, std::memory_order_relaxed);
+}
 
-    vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
+// Settings given on the command line. Zero (or an empty output) keeps the scene's value.
+struct command_line {
+    std::vector<std::string> scene_files;
+    int image_width = 0;
+    int image_height = 0;
+    int samples_per_pixel = 0;
+    int max_depth = 0;
+    int rr_depth = 0;
+    double adaptive_threshold = -1; // negative: keep the scene's
+    std::string output;
+    int tile_size = 32;
+    int threads = 0; // 0: all cores
+    bool wavefront = false;
+    bool sort_rays = false; // implies wavefront
+    int packet_size = 0;    // implies wavefront
+    double progress_interval = 0.5;
+    std::string progress_file; // receives one JSON progress record per line
+    std::string stats_file;    // receives one JSON statistics record per scene
+
+    void apply(scene_config &config) const {
+        auto &settings = config.settings;
+        if (image_width > 0)
+            settings.image_width = image_width;
+        if (image_height > 0)
+            settings.image_height = image_height;
+        if (samples_per_pixel > 0)
+            settings.samples_per_pixel = samples_per_pixel;
+        if (max_depth > 0)
+            settings.max_depth = max_depth;
+        if (rr_depth > 0)
+            settings.rr_depth = rr_depth;
+        if (adaptive_threshold >= 0)
+            settings.adaptive_threshold = adaptive_threshold;
+        if (!output.empty())
+            config.output = output;
+    }
+};
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus);
+void print_usage(const char *program) {
+    std::cerr << "Usage: " << program << " [options] [scene files...]\n"
+              << "  -W, --width <pixels>          image width, at most 16384\n"
+              << "  -H, --height <pixels>         image height, at most 16384\n"
+              << "  -s, --spp <samples>           samples per pixel\n"
+              << "  -t, --adaptive-threshold <t>  adaptive sampling threshold, 0 disables it\n"
+              << "  -d, --max-depth <bounces>     maximum path length\n"
+              << "      --rr-depth <bounces>      bounce after which Russian roulette starts\n"
+              << "      --tile <pixels>           tile size (default 32)\n"
+              << "      --wavefront               trace each tile in stages over ray queues\n"
+              << "      --sort-rays               wavefront, with secondary rays sorted by direction and origin\n"
+              << "      --packets <4|8|16>        wavefront, with camera rays traced in packets of this size\n"
+              << "  -j, --threads <n>             worker threads (default: all cores)\n"
+              << "      --progress-interval <s>   seconds between progress reports (default 0.5)\n"
+              << "      --progress-file <path>    also write progress as JSON lines to a file or pipe\n"
+              << "      --stats-json <path>       write ray and intersection statistics as JSON lines\n"
+              << "  -o, --output <file.png>       output image, for a single scene\n"
+              << "  -h, --help                    show this message\n"
+              << "Without scene files the built-in Sierpinski scene is rendered.\n";
+}
 
-    // Set the desired tile size
-    int desired_tile_size = 32;
+// Returns false, after reporting why, if the arguments are invalid.
+bool parse_command_line(int argc, char *argv[], command_line &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.empty() || arg[0] != '-') {
+            options.scene_files.push_back(arg);
+            continue;
+        }
+        if (arg == "-h" || arg == "--help")
+            return false;
+        if (arg == "--wavefront") {
+            options.wavefront = true;
+            continue;
+        }
+        if (arg == "--sort-rays") {
+            options.wavefront = true;
+            options.sort_rays = true;
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            std::cerr << "ERROR: Missing value for " << arg << ".\n";
+            return false;
+        }
+        const char *value = argv[++i];
+        char *end;
+
+        if (arg == "-o" || arg == "--output") {
+            options.output = value;
+        } else if (arg == "--progress-file") {
+            options.progress_file = value;
+        } else if (arg == "--stats-json") {
+            options.stats_file = value;
+        } else if (arg == "-t" || arg == "--adaptive-threshold") {
+            options.adaptive_threshold = std::strtod(value, &end);
+            if (*end != '\0' || end == value || options.adaptive_threshold < 0) {
+                std::cerr << "ERROR: Invalid value '" << value << "' for " << arg << ".\n";
+                return false;
+            }
+        } else if (arg == "--packets") {
+            long n = std::strtol(value, &end, 10);
+            if (*end != '\0' || end == value || (n != 4 && n != 8 && n != 16)) {
+                std::cerr << "ERROR: Invalid value '" << value << "' for " << arg << ", expected 4, 8 or 16.\n";
+                return false;
+            }
+            options.packet_size = static_cast<int>(n);
+            options.wavefront = true;
+        } else if (arg == "--progress-interval") {
+            options.progress_interval = std::strtod(value, &end);
+            if (*end != '\0' || end == value || !(options.progress_interval > 0)) {
+                std::cerr << "ERROR: Invalid value '" << value << "' for " << arg << ".\n";
+                return false;
+            }
+        } else {
+            int *target = nullptr;
+            int min_value = 1;
+            int max_value = 1000000;
+            if (arg == "-W" || arg == "--width") {
+                // Same bound as the scene file's resolution statement.
+                target = &options.image_width;
+                min_value = 2;
+                max_value = 16384;
+            } else if (arg == "-H" || arg == "--height") {
+                target = &options.image_height;
+                min_value = 2;
+                max_value = 16384;
+            } else if (arg == "-s" || arg == "--spp") {
+                target = &options.samples_per_pixel;
+            } else if (arg == "-d" || arg == "--max-depth") {
+                target = &options.max_depth;
+            } else if (arg == "--rr-depth") {
+                target = &options.rr_depth;
+            } else if (arg == "--tile") {
+                target = &options.tile_size;
+            } else if (arg == "-j" || arg == "--threads") {
+                target = &options.threads;
+            } else {
+                std::cerr << "ERROR: Unknown option " << arg << ".\n";
+                return false;
+            }
+
+            long n = std::strtol(value, &end, 10);
+            if (*end != '\0' || end == value || n < min_value || n > max_value) {
+                std::cerr << "ERROR: Invalid value '" << value << "' for " << arg << ".\n";
+                return false;
+            }
+            *target = static_cast<int>(n);
+        }
+    }
+
+    if (!options.output.empty() && options.scene_files.size() > 1) {
+        std::cerr << "ERROR: --output can only be used with a single scene.\n";
+        return false;
+    }
+    return true;
+}
+
+// Renders one scene to its output file.
+void render_scene(scene_config &config, const command_line &options, std::ostream *progress_output,
+                  std::ostream *stats_output) {
+    auto &settings = config.settings;
+    const int image_height = settings.image_height;
+    const int image_width = settings.image_width;
+
+    auto image = std::make_shared<std::vector<color>>(static_cast<size_t>(image_height) * image_width);
+
+    // Emitters sampled directly at every diffuse bounce, collected before finalize_scene
+    // moves the top-level objects into a BVH.
+    hittable_list &world = config.world;
+    hittable_list lights = collect_lights(world);
+    finalize_scene(world, config.time0, config.time1);
+
+    // Camera
+
+    camera cam = config.make_camera();
+
+    int desired_tile_size = options.tile_size;
 
     // Calculate the number of horizontal and vertical tiles
     int num_horizontal_tiles = (image_width + desired_tile_size - 1) / desired_tile_size;
@@ -263,24 +827,114 @@ int main() {
     int actual_tile_width = (image_width + num_horizontal_tiles - 1) / num_horizontal_tiles;
     int actual_tile_height = (image_height + num_vertical_tiles - 1) / num_vertical_tiles;
 
+    std::unique_ptr<ray_binner> binner;
+    aabb world_box;
+    if (options.sort_rays && world.bounding_box(config.time0, config.time1, world_box))
+        binner = std::make_unique<ray_binner>(world_box);
+    wavefront_options wave;
+    wave.binner = binner.get();
+    wave.packet_size = options.packet_size;
+
+    stats_registry::reset();
+    auto render_start = std::chrono::steady_clock::now();
+    render_progress progress;
+    progress_reporter reporter(progress, static_cast<long>(image_width) * image_height, options.progress_interval,
+                               progress_output);
+
     tbb::parallel_for(
             tbb::blocked_range2d<int>(0, image_height, actual_tile_height, 0, image_width, actual_tile_width),
             [&](const tbb::blocked_range2d<int>& tile_range) {
-                render_tile(tile_range, settings, image, cam, world, lines_rendered);
+                if (options.wavefront)
+                    render_tile_wavefront(tile_range, settings, image, cam, world, lights, wave, progress);
+                else
+                    render_tile(tile_range, settings, image, cam, world, lights, progress);
             }
     );
+    reporter.stop();
+    auto render_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
 
 
-    std::vector<unsigned char> image_data(image_width * image_height * 3);
+    std::vector<unsigned char> image_data(static_cast<size_t>(image_width) * image_height * 3);
 
     for (int i = image_height - 1; i >= 0; i--) {
         for (int j = 0; j < image_width; ++j) {
-            int index = (image_height - i - 1) * image_width + j;
-            write_color(image_data, index, (*image)[i * image_width + j], samples_per_pixel);
+            size_t index = static_cast<size_t>(image_height - i - 1) * image_width + j;
+            write_color(image_data, index, (*image)[static_cast<size_t>(i) * image_width + j], 1);
         }
     }
 
     std::cout << "\nDone!\n";
-    stbi_write_png("image.png", image_width, image_height, 3, image_data.data(), image_width * 3);
-    return 0;
+#if TRACERGEN_STATS
+    auto stats = stats_registry::total();
+    print_stats(std::cout, stats, render_seconds);
+    if (stats_output) {
+        write_stats_json(*stats_output, config.output, stats, render_seconds);
+        stats_output->flush();
+    }
+#else
+    (void) render_seconds;
+    (void) stats_output;
+#endif
+    stbi_write_png(config.output.c_str(), image_width, image_height, 3, image_data.data(), image_width * 3);
+}
+
+// Every scene file is rendered in turn in the same process (see scene_file.h for the
+// format), with the command line settings overriding the file's. Without scene files the
+// built-in Sierpinski scene is rendered to image.png.
+int main(int argc, char *argv[]) {
+    command_line options;
+    if (!parse_command_line(argc, argv, options)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+
+    // Caps the TBB worker pool for the whole process, so renders can share a host.
+    std::unique_ptr<tbb::global_control> thread_limit;
+    if (options.threads > 0)
+        thread_limit = std::make_unique<tbb::global_control>(
+                tbb::global_control::max_allowed_parallelism, static_cast<size_t>(options.threads));
+
+    std::ofstream progress_file;
+    if (!options.progress_file.empty()) {
+        progress_file.open(options.progress_file);
+        if (!progress_file) {
+            std::cerr << "ERROR: Could not open progress file '" << options.progress_file << "'.\n";
+            return 2;
+        }
+    }
+    std::ostream *progress_output = progress_file.is_open() ? &progress_file : nullptr;
+
+    std::ofstream stats_file;
+    if (!options.stats_file.empty()) {
+        if (!TRACERGEN_STATS)
+            std::cerr << "Statistics are compiled out (TRACERGEN_STATS=0); '" << options.stats_file
+                      << "' will stay empty.\n";
+        stats_file.open(options.stats_file);
+        if (!stats_file) {
+            std::cerr << "ERROR: Could not open statistics file '" << options.stats_file << "'.\n";
+            return 2;
+        }
+    }
+    std::ostream *stats_output = stats_file.is_open() ? &stats_file : nullptr;
+
+    if (options.scene_files.empty()) {
+        scene_config config;
+        builtin_scene("sierpinski", config);
+        options.apply(config);
+        render_scene(config, options, progress_output, stats_output);
+        return 0;
+    }
+
+    int failed = 0;
+    for (const auto &scene_file: options.scene_files) {
+        scene_config config;
+        if (!load_scene_file(scene_file, config)) {
+            failed++;
+            continue;
+        }
+        options.apply(config);
+        std::cout << "Rendering " << scene_file << " to " << config.output << "\n";
+        render_scene(config, options, progress_output, stats_output);
+    }
+    return failed == 0 ? 0 : 1;
 }
@@ -14,8 +14,15 @@ public:
     }
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const = 0;
+
+    // Solid angle density with which scatter() picks the direction of scattered, so that
+    // attenuation * scattering_pdf is the BSDF times the cosine term. Materials scattering
+    // into a single direction (mirrors, glass) keep 0 and are skipped by light sampling.
+    virtual double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const {
+        return 0;
+    }
 };
 
 class lambertian : public material {
@@ -26,9 +33,9 @@ public:
 
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        auto scatter_direction = rec.normal + random_unit_vector(rng);
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
@@ -39,6 +46,12 @@ public:
         return true;
     }
 
+    virtual double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+        // normal + random_unit_vector is cosine distributed.
+        auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+        return cosine < 0 ? 0 : cosine / pi;
+    }
+
 public:
     shared_ptr<texture> albedo;
 };
@@ -48,10 +61,10 @@ public:
     metal(const color &a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(rng), r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -66,7 +79,7 @@ public:
     dielectric(double index_of_refraction) : ir(index_of_refraction) {}
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const override {
         attenuation = color(1.0, 1.0, 1.0);
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
@@ -78,7 +91,7 @@ public:
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > rng.next_double())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -106,7 +119,7 @@ public:
     diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const override {
         return false;
     }
@@ -126,13 +139,17 @@ public:
     isotropic(shared_ptr<texture> a) : albedo(a) {}
 
     virtual bool scatter(
-            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered
+            const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, sampler &rng
     ) const override {
-        scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+        scattered = ray(rec.p, random_in_unit_sphere(rng), r_in.time());
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    virtual double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override {
+        return 1 / (4 * pi);
+    }
+
 public:
     shared_ptr<texture> albedo;
 };
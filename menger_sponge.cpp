@@ -3,38 +3,127 @@
 //
 
 #include "menger_sponge.h"
-#include "box.h"
 
-MengerSponge::MengerSponge(const point3& center, double side_length, int iterations, shared_ptr<material> mat) {
-    sponge = create_sponge(center, side_length, iterations, mat);
+#include <algorithm>
+
+MengerSponge::MengerSponge(const point3& center, double side_length, int iterations, shared_ptr<material> mat)
+        : sponge_min(center - vec3(side_length / 2, side_length / 2, side_length / 2)), side(side_length),
+          depth(iterations), mat_ptr(mat) {}
+
+static bool is_kept_cell(int x, int y, int z) {
+    // Neither the center cell nor one of the eight corners.
+    int offsets = (x != 1) + (y != 1) + (z != 1);
+    return offsets == 1 || offsets == 2;
 }
 
-hittable_list MengerSponge::create_sponge(const point3& center, double side_length, int iterations, shared_ptr<material> mat) {
-    hittable_list sponge_parts;
-    if (iterations == 0) {
-        sponge_parts.add(make_shared<box>(center - vec3(side_length / 2, side_length / 2, side_length / 2), center + vec3(side_length / 2, side_length / 2, side_length / 2), mat));
-    } else {
-        double new_side = side_length / 3;
-        for (int x = -1; x <= 1; ++x) {
-            for (int y = -1; y <= 1; ++y) {
-                for (int z = -1; z <= 1; ++z) {
-                    if (x != 0 || y != 0 || z != 0) {
-                        if (abs(x) + abs(y) + abs(z) != 3) {
-                            point3 new_center = center + side_length * point3(x, y, z) / 3;
-                            sponge_parts.add(make_shared<hittable_list>(create_sponge(new_center, new_side, iterations - 1, mat)));
-                        }
-                    }
-                }
-            }
+bool MengerSponge::hit_cell(const ray& r, const vec3& inv_dir, const point3& cell_min, double side_length, int level,
+                            double t_min, double t_max, hit_record* rec) const {
+    // Slab test against the cell, remembering the axis of the entry and exit planes.
+    double t_enter = -infinity;
+    double t_exit = infinity;
+    int enter_axis = 0;
+    int exit_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        auto t0 = (cell_min[a] - r.origin()[a]) * inv_dir[a];
+        auto t1 = (cell_min[a] + side_length - r.origin()[a]) * inv_dir[a];
+        if (inv_dir[a] < 0.0)
+            std::swap(t0, t1);
+        if (t0 > t_enter) {
+            t_enter = t0;
+            enter_axis = a;
+        }
+        if (t1 < t_exit) {
+            t_exit = t1;
+            exit_axis = a;
+        }
+    }
+    if (t_exit < t_enter || t_exit < t_min || t_enter > t_max)
+        return false;
+
+    if (level == 0) {
+        // Solid cube: report the entry face, or the exit face for rays starting inside.
+        int axis = enter_axis;
+        double t = t_enter;
+        if (t < t_min) {
+            if (t_exit > t_max)
+                return false;
+            axis = exit_axis;
+            t = t_exit;
+        }
+        if (!rec)
+            return true;
+
+        rec->t = t;
+        rec->p = r.at(t);
+        int u_axis = axis == 0 ? 1 : 0;
+        int v_axis = axis == 2 ? 1 : 2;
+        rec->u = (rec->p[u_axis] - cell_min[u_axis]) / side_length;
+        rec->v = (rec->p[v_axis] - cell_min[v_axis]) / side_length;
+        vec3 outward_normal(0, 0, 0);
+        outward_normal[axis] = 1;
+        rec->set_face_normal(r, outward_normal);
+        rec->mat_ptr = mat_ptr.get();
+        return true;
+    }
+
+    // 3D DDA through the 3x3x3 sub-cells crossed by the ray, nearest first.
+    double sub_side = side_length / 3;
+    double t = std::max(t_enter, t_min);
+    double t_end = std::min(t_exit, t_max);
+    point3 entry = r.at(t);
+    int cell[3];
+    int step[3];
+    double t_next[3];
+    double t_delta[3];
+    for (int a = 0; a < 3; a++) {
+        cell[a] = std::clamp(static_cast<int>((entry[a] - cell_min[a]) / sub_side), 0, 2);
+        if (r.direction()[a] > 0) {
+            step[a] = 1;
+            t_next[a] = (cell_min[a] + (cell[a] + 1) * sub_side - r.origin()[a]) * inv_dir[a];
+            t_delta[a] = sub_side * inv_dir[a];
+        } else if (r.direction()[a] < 0) {
+            step[a] = -1;
+            t_next[a] = (cell_min[a] + cell[a] * sub_side - r.origin()[a]) * inv_dir[a];
+            t_delta[a] = -sub_side * inv_dir[a];
+        } else {
+            step[a] = 0;
+            t_next[a] = infinity;
+            t_delta[a] = infinity;
+        }
+    }
+
+    while (true) {
+        if (is_kept_cell(cell[0], cell[1], cell[2])) {
+            point3 sub_min(cell_min[0] + cell[0] * sub_side,
+                           cell_min[1] + cell[1] * sub_side,
+                           cell_min[2] + cell[2] * sub_side);
+            if (hit_cell(r, inv_dir, sub_min, sub_side, level - 1, t_min, t_max, rec))
+                return true;
         }
+
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        if (t_next[axis] > t_end)
+            return false;
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] > 2)
+            return false;
+        t_next[axis] += t_delta[axis];
     }
-    return sponge_parts;
 }
 
 bool MengerSponge::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sponge.hit(r, t_min, t_max, rec);
+    TRACERGEN_COUNT(stat_menger_sponge_tests);
+    vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+    return hit_cell(r, inv_dir, sponge_min, side, depth, t_min, t_max, &rec);
+}
+
+bool MengerSponge::occluded(const ray& r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_menger_sponge_tests);
+    vec3 inv_dir(1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z());
+    return hit_cell(r, inv_dir, sponge_min, side, depth, t_min, t_max, nullptr);
 }
 
 bool MengerSponge::bounding_box(double t0, double t1, aabb& output_box) const {
-    return sponge.bounding_box(t0, t1, output_box);
+    output_box = aabb(sponge_min, sponge_min + vec3(side, side, side));
+    return true;
 }
@@ -8,20 +8,27 @@
 
 
 #include "hittable.h"
-#include "hittable_list.h"
 
+// Cube divided into 3x3x3 cells, keeping the 6 face and 12 edge cells of every level.
+// Intersected procedurally by walking the cells along the ray, so no geometry is stored.
 class MengerSponge : public hittable {
 public:
     MengerSponge() {}
     MengerSponge(const point3& center, double side_length, int iterations, shared_ptr<material> mat);
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
     virtual bool bounding_box(double t0, double t1, aabb& output_box) const override;
 
 private:
-    hittable_list create_sponge(const point3& center, double side_length, int iterations, shared_ptr<material> mat);
-    hittable_list sponge;
+    // Fills rec, when given, with the nearest hit in the cell.
+    bool hit_cell(const ray& r, const vec3& inv_dir, const point3& cell_min, double side_length, int level,
+                  double t_min, double t_max, hit_record* rec) const;
+
+    point3 sponge_min;
+    double side;
+    int depth;
+    shared_ptr<material> mat_ptr;
 };
 
 #endif // MENGER_SPONGE_H
-
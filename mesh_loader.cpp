@@ -0,0 +1,752 @@
+#include "mesh_loader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <type_traits>
+
+#include <tbb/tbb.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory map of a whole file, unmapped on destruction.
+class mapped_file {
+public:
+    explicit mapped_file(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = static_cast<const char *>(p);
+                size = static_cast<size_t>(st.st_size);
+                // Chunks are parsed concurrently, so ask for the whole file up front.
+                madvise(p, size, MADV_WILLNEED);
+            }
+        }
+        close(fd);
+    }
+
+    ~mapped_file() {
+        if (data)
+            munmap(const_cast<char *>(data), size);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+public:
+    const char *data = nullptr;
+    size_t size = 0;
+};
+
+static bool has_extension(const std::string &path, const char *extension) {
+    size_t n = std::strlen(extension);
+    if (path.size() < n)
+        return false;
+    for (size_t i = 0; i < n; i++) {
+        if (std::tolower(static_cast<unsigned char>(path[path.size() - n + i])) != extension[i])
+            return false;
+    }
+    return true;
+}
+
+static bool stat_mesh_source(const std::string &path, mesh_source &source) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+#ifdef __APPLE__
+    const struct timespec &mtime = st.st_mtimespec;
+#else
+    const struct timespec &mtime = st.st_mtim;
+#endif
+    source.size = static_cast<uint64_t>(st.st_size);
+    source.mtime_ns = static_cast<int64_t>(mtime.tv_sec) * 1000000000 + mtime.tv_nsec;
+    return true;
+}
+
+// Every parsed index must name an existing vertex.
+static bool indices_in_range(const mesh_data &mesh) {
+    auto n = static_cast<int>(mesh.vertices.size());
+    return tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, mesh.indices.size()), true,
+            [&](const tbb::blocked_range<size_t> &range, bool ok) {
+                for (size_t i = range.begin(); ok && i != range.end(); i++)
+                    ok = mesh.indices[i] >= 0 && mesh.indices[i] < n;
+                return ok;
+            },
+            [](bool a, bool b) { return a && b; });
+}
+
+// OBJ
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static const char *skip_blanks(const char *p, const char *end) {
+    while (p < end && is_blank(*p))
+        p++;
+    return p;
+}
+
+// Decimal floating point parser. Unlike strtod it stops at end instead of needing a
+// terminated string, and it does not look at the locale; the result may differ from
+// strtod in the last bit.
+static const char *parse_double(const char *p, const char *end, double &value) {
+    static const double powers_of_ten[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool any_digit = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, any_digit = true) {
+        if (mantissa < 100000000000000000ull)
+            mantissa = 10 * mantissa + (*p - '0');
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, any_digit = true) {
+            if (mantissa < 100000000000000000ull) {
+                mantissa = 10 * mantissa + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!any_digit)
+        return nullptr;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negative_exponent = *q++ == '-';
+        int e = 0;
+        bool any_exponent_digit = false;
+        for (; q < end && *q >= '0' && *q <= '9'; q++, any_exponent_digit = true)
+            e = std::min(10 * e + (*q - '0'), 10000);
+        if (any_exponent_digit) {
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    auto x = static_cast<double>(mantissa);
+    if (exponent >= 0)
+        x *= exponent <= 22 ? powers_of_ten[exponent] : std::pow(10.0, exponent);
+    else
+        x /= exponent >= -22 ? powers_of_ten[-exponent] : std::pow(10.0, -exponent);
+    value = negative ? -x : x;
+    return p;
+}
+
+static const char *parse_int(const char *p, const char *end, long &value) {
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    long x = 0;
+    const char *first = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        x = std::min(10 * x + (*p - '0'), 1L << 40);
+    if (p == first)
+        return nullptr;
+
+    value = negative ? -x : x;
+    return p;
+}
+
+// Result of parsing one chunk of an OBJ file. Negative (relative) face indices depend on
+// how many vertices precede the chunk, which is only known after all chunks are parsed;
+// they are stored relative to the chunk and listed in relative_slots.
+struct obj_chunk {
+    std::vector<point3> vertices;
+    std::vector<int> indices;
+    std::vector<size_t> relative_slots;
+    const char *error = nullptr;
+};
+
+static void parse_obj_chunk(const char *p, const char *end, obj_chunk &chunk) {
+    struct corner {
+        int index;
+        bool relative;
+    };
+    std::vector<corner> polygon;
+
+    while (p < end) {
+        auto newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        const char *line_end = newline ? newline : end;
+        const char *line = skip_blanks(p, line_end);
+        p = line_end + 1;
+
+        if (line_end - line < 2 || !is_blank(line[1]))
+            continue;
+
+        if (line[0] == 'v') {
+            point3 v;
+            const char *q = line + 1;
+            for (int a = 0; a < 3; a++) {
+                q = parse_double(skip_blanks(q, line_end), line_end, v[a]);
+                if (!q) {
+                    chunk.error = line;
+                    return;
+                }
+            }
+            chunk.vertices.push_back(v);
+        } else if (line[0] == 'f') {
+            // Corners are "v", "v/vt", "v//vn" or "v/vt/vn"; only v is used.
+            polygon.clear();
+            const char *q = skip_blanks(line + 1, line_end);
+            while (q < line_end) {
+                long index;
+                q = parse_int(q, line_end, index);
+                if (!q || index == 0) {
+                    chunk.error = line;
+                    return;
+                }
+                if (index > 0)
+                    polygon.push_back({static_cast<int>(std::min(index - 1, long(INT32_MAX))), false});
+                else
+                    polygon.push_back({static_cast<int>(std::max(static_cast<long>(chunk.vertices.size()) + index,
+                                                                 long(INT32_MIN))), true});
+                while (q < line_end && !is_blank(*q))
+                    q++;
+                q = skip_blanks(q, line_end);
+            }
+            if (polygon.size() < 3) {
+                chunk.error = line;
+                return;
+            }
+
+            for (size_t i = 1; i + 1 < polygon.size(); i++) {
+                for (const corner &c: {polygon[0], polygon[i], polygon[i + 1]}) {
+                    if (c.relative)
+                        chunk.relative_slots.push_back(chunk.indices.size());
+                    chunk.indices.push_back(c.index);
+                }
+            }
+        }
+    }
+}
+
+static bool load_obj(const std::string &path, const mapped_file &file, mesh_data &mesh) {
+    // Chunks start after a newline, so no line is split between two of them.
+    constexpr size_t chunk_size = 1 << 20;
+    const char *data = file.data;
+    const char *end = file.data + file.size;
+    size_t n_chunks = std::max<size_t>(1, file.size / chunk_size);
+
+    std::vector<const char *> starts(n_chunks + 1);
+    starts[0] = data;
+    starts[n_chunks] = end;
+    for (size_t i = 1; i < n_chunks; i++) {
+        const char *p = std::max(data + i * (file.size / n_chunks), starts[i - 1]);
+        auto newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        starts[i] = newline ? newline + 1 : end;
+    }
+
+    std::vector<obj_chunk> chunks(n_chunks);
+    tbb::parallel_for(size_t(0), n_chunks, [&](size_t i) {
+        parse_obj_chunk(starts[i], starts[i + 1], chunks[i]);
+    });
+
+    for (const obj_chunk &chunk: chunks) {
+        if (chunk.error) {
+            auto line = 1 + std::count(data, chunk.error, '\n');
+            std::cerr << "ERROR: Malformed line " << line << " in OBJ file '" << path << "'.\n";
+            return false;
+        }
+    }
+
+    std::vector<size_t> vertex_base(n_chunks + 1, 0);
+    std::vector<size_t> index_base(n_chunks + 1, 0);
+    for (size_t i = 0; i < n_chunks; i++) {
+        vertex_base[i + 1] = vertex_base[i] + chunks[i].vertices.size();
+        index_base[i + 1] = index_base[i] + chunks[i].indices.size();
+    }
+    if (vertex_base[n_chunks] > static_cast<size_t>(INT32_MAX)) {
+        std::cerr << "ERROR: Too many vertices in OBJ file '" << path << "'.\n";
+        return false;
+    }
+
+    mesh.vertices.resize(vertex_base[n_chunks]);
+    mesh.indices.resize(index_base[n_chunks]);
+    tbb::parallel_for(size_t(0), n_chunks, [&](size_t i) {
+        obj_chunk &chunk = chunks[i];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.begin() + vertex_base[i]);
+        for (size_t slot: chunk.relative_slots)
+            chunk.indices[slot] += static_cast<int>(vertex_base[i]);
+        std::copy(chunk.indices.begin(), chunk.indices.end(), mesh.indices.begin() + index_base[i]);
+        chunk = obj_chunk();
+    });
+
+    if (!indices_in_range(mesh)) {
+        std::cerr << "ERROR: Face references a missing vertex in OBJ file '" << path << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+// PLY
+
+enum class ply_type { int8, uint8, int16, uint16, int32, uint32, float32, float64 };
+
+static bool parse_ply_type(const std::string &name, ply_type &type) {
+    static const struct {
+        const char *names[2];
+        ply_type type;
+    } types[] = {
+            {{"char",   "int8"},    ply_type::int8},
+            {{"uchar",  "uint8"},   ply_type::uint8},
+            {{"short",  "int16"},   ply_type::int16},
+            {{"ushort", "uint16"},  ply_type::uint16},
+            {{"int",    "int32"},   ply_type::int32},
+            {{"uint",   "uint32"},  ply_type::uint32},
+            {{"float",  "float32"}, ply_type::float32},
+            {{"double", "float64"}, ply_type::float64},
+    };
+    for (const auto &t: types) {
+        if (name == t.names[0] || name == t.names[1]) {
+            type = t.type;
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t ply_size(ply_type type) {
+    switch (type) {
+        case ply_type::int8:
+        case ply_type::uint8:
+            return 1;
+        case ply_type::int16:
+        case ply_type::uint16:
+            return 2;
+        case ply_type::int32:
+        case ply_type::uint32:
+        case ply_type::float32:
+            return 4;
+        case ply_type::float64:
+            return 8;
+    }
+    return 0;
+}
+
+template <typename T>
+static T read_raw(const char *p, bool swap_bytes) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, p, sizeof(T));
+    if (swap_bytes)
+        std::reverse(bytes, bytes + sizeof(T));
+    T value;
+    std::memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+static double read_ply_value(const char *p, ply_type type, bool swap_bytes) {
+    switch (type) {
+        case ply_type::int8:
+            return read_raw<int8_t>(p, false);
+        case ply_type::uint8:
+            return read_raw<uint8_t>(p, false);
+        case ply_type::int16:
+            return read_raw<int16_t>(p, swap_bytes);
+        case ply_type::uint16:
+            return read_raw<uint16_t>(p, swap_bytes);
+        case ply_type::int32:
+            return read_raw<int32_t>(p, swap_bytes);
+        case ply_type::uint32:
+            return read_raw<uint32_t>(p, swap_bytes);
+        case ply_type::float32:
+            return read_raw<float>(p, swap_bytes);
+        case ply_type::float64:
+            return read_raw<double>(p, swap_bytes);
+    }
+    return 0;
+}
+
+struct ply_property {
+    std::string name;
+    ply_type type;
+    bool is_list = false;
+    ply_type count_type = ply_type::uint8;
+};
+
+struct ply_element {
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+
+    // Bytes per row, or 0 if a list property makes the rows variable-sized.
+    size_t fixed_stride() const {
+        size_t stride = 0;
+        for (const auto &property: properties) {
+            if (property.is_list)
+                return 0;
+            stride += ply_size(property.type);
+        }
+        return stride;
+    }
+};
+
+// Walks count variable-sized rows one by one; called for each row with the row start.
+// Returns the end of the element, or nullptr if it runs past the end of the file.
+template <typename RowFn>
+static const char *walk_ply_rows(const ply_element &element, const char *p, const char *end, bool swap_bytes,
+                                 RowFn &&row_fn) {
+    for (size_t row = 0; row < element.count; row++) {
+        const char *row_start = p;
+        for (const auto &property: element.properties) {
+            if (property.is_list) {
+                if (end - p < static_cast<ptrdiff_t>(ply_size(property.count_type)))
+                    return nullptr;
+                auto n = static_cast<size_t>(read_ply_value(p, property.count_type, swap_bytes));
+                p += ply_size(property.count_type);
+                if (static_cast<size_t>(end - p) / ply_size(property.type) < n)
+                    return nullptr;
+                p += n * ply_size(property.type);
+            } else {
+                if (end - p < static_cast<ptrdiff_t>(ply_size(property.type)))
+                    return nullptr;
+                p += ply_size(property.type);
+            }
+        }
+        row_fn(row_start);
+    }
+    return p;
+}
+
+static bool load_ply(const std::string &path, const mapped_file &file, mesh_data &mesh) {
+    auto fail = [&](const char *message) {
+        std::cerr << "ERROR: " << message << " in PLY file '" << path << "'.\n";
+        mesh = mesh_data();
+        return false;
+    };
+
+    const char *end = file.data + file.size;
+    const char *header_end = nullptr;
+    for (const char *p = file.data; p < end; ) {
+        auto newline = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!newline)
+            break;
+        if (newline - p >= 10 && std::memcmp(p, "end_header", 10) == 0) {
+            header_end = newline + 1;
+            break;
+        }
+        p = newline + 1;
+    }
+    if (!header_end)
+        return fail("Missing end_header");
+
+    std::istringstream header(std::string(file.data, header_end));
+    std::vector<ply_element> elements;
+    std::string line, format;
+    std::getline(header, line);
+    if (line.compare(0, 3, "ply") != 0)
+        return fail("Missing ply signature");
+
+    while (std::getline(header, line)) {
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format") {
+            words >> format;
+        } else if (keyword == "element") {
+            ply_element element;
+            words >> element.name >> element.count;
+            elements.push_back(element);
+        } else if (keyword == "property") {
+            if (elements.empty())
+                return fail("Property outside of an element");
+            ply_property property;
+            std::string type;
+            words >> type;
+            if (type == "list") {
+                std::string count_type;
+                words >> count_type >> type;
+                property.is_list = true;
+                if (!parse_ply_type(count_type, property.count_type))
+                    return fail("Unknown property type");
+            }
+            if (!parse_ply_type(type, property.type))
+                return fail("Unknown property type");
+            words >> property.name;
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    const uint16_t one = 1;
+    bool little_endian_host = *reinterpret_cast<const uint8_t *>(&one) == 1;
+    bool swap_bytes;
+    if (format == "binary_little_endian")
+        swap_bytes = !little_endian_host;
+    else if (format == "binary_big_endian")
+        swap_bytes = little_endian_host;
+    else
+        return fail("Only binary PLY is supported, not this format");
+
+    const char *p = header_end;
+    bool have_vertices = false;
+    for (const ply_element &element: elements) {
+        size_t stride = element.fixed_stride();
+
+        if (element.name == "vertex") {
+            if (stride == 0)
+                return fail("List property in vertex element");
+            if (element.count > static_cast<size_t>(INT32_MAX))
+                return fail("Too many vertices");
+            if (static_cast<size_t>(end - p) / stride < element.count)
+                return fail("Truncated vertex data");
+
+            size_t offset[3] = {stride, stride, stride};
+            ply_type type[3] = {};
+            size_t property_offset = 0;
+            for (const auto &property: element.properties) {
+                for (int a = 0; a < 3; a++) {
+                    if (property.name == std::string(1, static_cast<char>('x' + a))) {
+                        offset[a] = property_offset;
+                        type[a] = property.type;
+                    }
+                }
+                property_offset += ply_size(property.type);
+            }
+            if (offset[0] == stride || offset[1] == stride || offset[2] == stride)
+                return fail("Missing x, y or z vertex property");
+
+            mesh.vertices.resize(element.count);
+            const char *rows = p;
+            tbb::parallel_for(tbb::blocked_range<size_t>(0, element.count), [&](const tbb::blocked_range<size_t> &r) {
+                for (size_t i = r.begin(); i != r.end(); i++) {
+                    const char *row = rows + i * stride;
+                    for (int a = 0; a < 3; a++)
+                        mesh.vertices[i][a] = read_ply_value(row + offset[a], type[a], swap_bytes);
+                }
+            });
+            p += element.count * stride;
+            have_vertices = true;
+        } else if (element.name == "face") {
+            int list = -1;
+            for (size_t i = 0; i < element.properties.size(); i++) {
+                const auto &property = element.properties[i];
+                if (property.is_list && (property.name == "vertex_indices" || property.name == "vertex_index"))
+                    list = static_cast<int>(i);
+            }
+            if (list < 0)
+                return fail("Missing vertex_indices face property");
+            const ply_property &indices = element.properties[list];
+            size_t count_size = ply_size(indices.count_type);
+            size_t index_size = ply_size(indices.type);
+
+            // Triangle meshes are the common case: if every face is a triangle the rows have
+            // a fixed size and can be decoded in parallel. Checking that is a parallel scan
+            // of the count bytes, so it costs little when it fails.
+            size_t triangle_stride = count_size + 3 * index_size;
+            bool all_triangles = element.properties.size() == 1 &&
+                                 static_cast<size_t>(end - p) / triangle_stride >= element.count;
+            if (all_triangles) {
+                const char *rows = p;
+                all_triangles = tbb::parallel_reduce(
+                        tbb::blocked_range<size_t>(0, element.count), true,
+                        [&](const tbb::blocked_range<size_t> &r, bool ok) {
+                            for (size_t i = r.begin(); ok && i != r.end(); i++)
+                                ok = read_ply_value(rows + i * triangle_stride, indices.count_type, swap_bytes) == 3;
+                            return ok;
+                        },
+                        [](bool a, bool b) { return a && b; });
+            }
+
+            if (all_triangles) {
+                const char *rows = p;
+                mesh.indices.resize(3 * element.count);
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, element.count), [&](const tbb::blocked_range<size_t> &r) {
+                    for (size_t i = r.begin(); i != r.end(); i++) {
+                        const char *row = rows + i * triangle_stride + count_size;
+                        for (int k = 0; k < 3; k++)
+                            mesh.indices[3 * i + k] = static_cast<int>(
+                                    read_ply_value(row + k * index_size, indices.type, swap_bytes));
+                    }
+                });
+                p += element.count * triangle_stride;
+            } else {
+                size_t list_offset = 0;
+                bool fixed_offset = true;
+                for (int i = 0; i < list; i++) {
+                    fixed_offset &= !element.properties[i].is_list;
+                    list_offset += ply_size(element.properties[i].type);
+                }
+                if (!fixed_offset)
+                    return fail("Variable-sized property before vertex_indices");
+
+                p = walk_ply_rows(element, p, end, swap_bytes, [&](const char *row) {
+                    const char *q = row + list_offset;
+                    auto n = static_cast<int>(read_ply_value(q, indices.count_type, swap_bytes));
+                    q += count_size;
+                    auto first = static_cast<int>(read_ply_value(q, indices.type, swap_bytes));
+                    for (int k = 1; k + 1 < n; k++) {
+                        mesh.indices.push_back(first);
+                        mesh.indices.push_back(static_cast<int>(
+                                read_ply_value(q + k * index_size, indices.type, swap_bytes)));
+                        mesh.indices.push_back(static_cast<int>(
+                                read_ply_value(q + (k + 1) * index_size, indices.type, swap_bytes)));
+                    }
+                });
+                if (!p)
+                    return fail("Truncated face data");
+            }
+        } else if (stride > 0) {
+            if (static_cast<size_t>(end - p) / stride < element.count)
+                return fail("Truncated element data");
+            p += element.count * stride;
+        } else {
+            p = walk_ply_rows(element, p, end, swap_bytes, [](const char *) {});
+            if (!p)
+                return fail("Truncated element data");
+        }
+    }
+
+    if (!have_vertices)
+        return fail("Missing vertex element");
+    if (!indices_in_range(mesh))
+        return fail("Face references a missing vertex");
+    return true;
+}
+
+// Cache
+
+struct mesh_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t vertex_size; // sizeof(point3) of the writer
+    uint64_t vertex_count;
+    uint64_t index_count;
+    uint64_t source_size;     // of the parsed file, 0 if written without one
+    int64_t source_mtime_ns;
+};
+
+static const char mesh_cache_magic[8] = {'T', 'G', 'M', 'E', 'S', 'H', '\0', '\0'};
+static const uint32_t mesh_cache_version = 2;
+
+static_assert(std::is_trivially_copyable<point3>::value, "point3 is written to the cache as raw bytes");
+
+bool write_mesh_cache(const std::string &path, const mesh_data &mesh, const mesh_source &source) {
+    mesh_cache_header header{};
+    std::memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+    header.version = mesh_cache_version;
+    header.vertex_size = sizeof(point3);
+    header.vertex_count = mesh.vertices.size();
+    header.index_count = mesh.indices.size();
+    header.source_size = source.size;
+    header.source_mtime_ns = source.mtime_ns;
+
+    // Written next to the target and renamed, so a concurrent reader never sees half a file.
+    // The pid keeps two processes caching the same mesh from writing the same temporary.
+    std::string temporary = path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(mesh.vertices.data()),
+                  static_cast<std::streamsize>(mesh.vertices.size() * sizeof(point3)));
+        out.write(reinterpret_cast<const char *>(mesh.indices.data()),
+                  static_cast<std::streamsize>(mesh.indices.size() * sizeof(int)));
+        if (!out) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+    }
+    return std::rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+bool read_mesh_cache(const std::string &path, mesh_data &mesh, const mesh_source *expected) {
+    mapped_file file(path);
+    mesh_cache_header header;
+    if (file.size < sizeof(header))
+        return false;
+
+    std::memcpy(&header, file.data, sizeof(header));
+    if (std::memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0 ||
+        header.version != mesh_cache_version || header.vertex_size != sizeof(point3) ||
+        header.vertex_count > static_cast<uint64_t>(INT32_MAX) || header.index_count % 3 != 0)
+        return false;
+    if (expected && (header.source_size != expected->size || header.source_mtime_ns != expected->mtime_ns))
+        return false;
+
+    uint64_t vertex_bytes = header.vertex_count * sizeof(point3);
+    uint64_t index_bytes = header.index_count * sizeof(int);
+    if (file.size != sizeof(header) + vertex_bytes + index_bytes)
+        return false;
+
+    mesh.vertices.resize(header.vertex_count);
+    mesh.indices.resize(header.index_count);
+    const char *vertex_data = file.data + sizeof(header);
+    std::memcpy(mesh.vertices.data(), vertex_data, vertex_bytes);
+    std::memcpy(mesh.indices.data(), vertex_data + vertex_bytes, index_bytes);
+
+    if (!indices_in_range(mesh)) {
+        mesh = mesh_data();
+        return false;
+    }
+    return true;
+}
+
+bool load_mesh(const std::string &path, mesh_data &mesh, bool use_cache) {
+    mesh = mesh_data();
+
+    if (has_extension(path, ".tgm")) {
+        if (read_mesh_cache(path, mesh))
+            return true;
+        std::cerr << "ERROR: Could not read mesh cache '" << path << "'.\n";
+        return false;
+    }
+
+    // Taken before the file is read: if it changes while it is parsed, the cache written
+    // below no longer matches it and is ignored next time.
+    std::string cache_path = path + ".tgm";
+    mesh_source source;
+    use_cache = use_cache && stat_mesh_source(path, source);
+    if (use_cache && read_mesh_cache(cache_path, mesh, &source))
+        return true;
+
+    mapped_file file(path);
+    if (!file.data) {
+        std::cerr << "ERROR: Could not open mesh file '" << path << "'.\n";
+        return false;
+    }
+
+    bool loaded;
+    if (has_extension(path, ".obj")) {
+        loaded = load_obj(path, file, mesh);
+    } else if (has_extension(path, ".ply")) {
+        loaded = load_ply(path, file, mesh);
+    } else {
+        std::cerr << "ERROR: Unknown mesh format '" << path << "', expected .obj, .ply or .tgm.\n";
+        return false;
+    }
+
+    if (!loaded) {
+        mesh = mesh_data();
+        return false;
+    }
+
+    if (use_cache && !write_mesh_cache(cache_path, mesh, source))
+        std::cerr << "Could not write mesh cache '" << cache_path << "'.\n";
+    return true;
+}
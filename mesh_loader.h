@@ -0,0 +1,46 @@
+#ifndef TRACERGEN_MESH_LOADER_H
+#define TRACERGEN_MESH_LOADER_H
+
+#include "triangle_mesh.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Indexed triangles as read from a file, ready to be moved into a triangle_mesh.
+struct mesh_data {
+    std::vector<point3> vertices;
+    std::vector<int> indices; // three per triangle
+
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+// Loads an OBJ or binary PLY file, chosen by extension. The file is memory mapped and
+// split into chunks that are parsed in parallel; polygons are fan triangulated and only
+// positions are kept. With use_cache, a "<path>.tgm" cache (see write_mesh_cache) made
+// from a file of the same size and nanosecond modification time is read instead, and one
+// is written after a successful parse.
+// Errors are reported on std::cerr and leave mesh empty.
+bool load_mesh(const std::string &path, mesh_data &mesh, bool use_cache = true);
+
+// The file a cache was made from, as recorded in the cache header.
+struct mesh_source {
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+};
+
+// Native cache format: a fixed header followed by the raw vertex and index arrays, so
+// reading it back is a memory map and two copies with no parsing. read_mesh_cache fails
+// unless the recorded source matches expected, when one is given.
+bool write_mesh_cache(const std::string &path, const mesh_data &mesh, const mesh_source &source = mesh_source());
+bool read_mesh_cache(const std::string &path, mesh_data &mesh, const mesh_source *expected = nullptr);
+
+// Convenience wrapper for scenes; returns nullptr if the file could not be loaded.
+inline shared_ptr<triangle_mesh> load_triangle_mesh(const std::string &path, shared_ptr<material> mat) {
+    mesh_data mesh;
+    if (!load_mesh(path, mesh) || mesh.indices.empty())
+        return nullptr;
+    return make_shared<triangle_mesh>(std::move(mesh.vertices), std::move(mesh.indices), mat);
+}
+
+#endif //TRACERGEN_MESH_LOADER_H
@@ -16,6 +16,12 @@ public:
     virtual bool hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
     virtual bool bounding_box(
             double _time0, double _time1, aabb &output_box) const override;
 
@@ -26,13 +32,17 @@ public:
     double time0, time1;
     double radius;
     shared_ptr<material> mat_ptr;
+
+private:
+    // Nearest intersection distance within [t_min, t_max].
+    bool find_root(const ray &r, double t_min, double t_max, double &root) const;
 };
 
 point3 moving_sphere::center(double time) const {
     return center0 + ((time - time0) / (time1 - time0)) * (center1 - center0);
 }
 
-bool moving_sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+bool moving_sphere::find_root(const ray &r, double t_min, double t_max, double &root) const {
     vec3 oc = r.origin() - center(r.time());
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -43,20 +53,44 @@ bool moving_sphere::hit(const ray &r, double t_min, double t_max, hit_record &re
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool moving_sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool moving_sphere::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_moving_sphere_tests);
+    double root;
+    if (!find_root(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
+    rec.object = this;
+    return true;
+}
+
+void moving_sphere::finish_hit(const ray &r, hit_record &rec) const {
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+bool moving_sphere::occluded(const ray &r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_moving_sphere_tests);
+    double root;
+    return find_root(r, t_min, t_max, root);
 }
 
 bool moving_sphere::bounding_box(double _time0, double _time1, aabb &output_box) const {
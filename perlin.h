@@ -6,14 +6,15 @@
 class perlin {
 public:
     perlin() {
+        auto &rng = thread_sampler();
         ranvec = new vec3[point_count];
         for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(random(-1, 1));
+            ranvec[i] = unit_vector(random(-1, 1, rng));
         }
 
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        perm_x = perlin_generate_perm(rng);
+        perm_y = perlin_generate_perm(rng);
+        perm_z = perlin_generate_perm(rng);
     }
 
     ~perlin() {
@@ -65,20 +66,20 @@ private:
     int *perm_y;
     int *perm_z;
 
-    static int *perlin_generate_perm() {
+    static int *perlin_generate_perm(sampler &rng) {
         auto p = new int[point_count];
 
         for (int i = 0; i < perlin::point_count; i++)
             p[i] = i;
 
-        permute(p, point_count);
+        permute(p, point_count, rng);
 
         return p;
     }
 
-    static void permute(int *p, int n) {
+    static void permute(int *p, int n, sampler &rng) {
         for (int i = n - 1; i > 0; i--) {
-            int target = random_int(0, i);
+            int target = random_int(0, i, rng);
             int tmp = p[i];
             p[i] = p[target];
             p[target] = tmp;
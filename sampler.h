@@ -0,0 +1,75 @@
+#ifndef TRACERGEN_SAMPLER_H
+#define TRACERGEN_SAMPLER_H
+
+#include <cstdint>
+#include <cstring>
+
+// PCG32 random number generator (O'Neill, pcg-random.org). Its whole state is 16 bytes,
+// so every thread or every camera sample can own one instead of sharing a generator.
+class sampler {
+public:
+    sampler() : sampler(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL) {}
+
+    sampler(uint64_t seed, uint64_t stream) {
+        state = 0;
+        inc = (stream << 1u) | 1u;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    // Generator of one camera sample. It only depends on the pixel and the sample index,
+    // so an image does not depend on how its pixels were spread over threads.
+    static sampler for_pixel(uint64_t pixel_index, uint64_t sample_index) {
+        return sampler(mix(pixel_index ^ mix(sample_index)), pixel_index);
+    }
+
+    uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        auto xorshifted = static_cast<uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        auto rot = static_cast<uint32_t>(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31u));
+    }
+
+    // Returns a random real in [0,1).
+    double next_double() {
+        return next_uint() * 0x1p-32;
+    }
+
+    // Returns a random real in [min,max).
+    double next_double(double min, double max) {
+        return min + (max - min) * next_double();
+    }
+
+    // Generator seeded with the bits of a ray. Used where no sampler is passed down (e.g.
+    // hittable::hit): the result is still deterministic for a given path.
+    static sampler for_ray(const double *origin, const double *direction) {
+        uint64_t h = 0;
+        for (int i = 0; i < 3; i++) {
+            h = mix(h ^ bits(origin[i]));
+            h = mix(h ^ bits(direction[i]));
+        }
+        return sampler(h, 0);
+    }
+
+    // SplitMix64 finalizer, used to turn indices and bit patterns into seeds.
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30u)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27u)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31u);
+    }
+
+private:
+    static uint64_t bits(double x) {
+        uint64_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        return u;
+    }
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+#endif //TRACERGEN_SAMPLER_H
@@ -0,0 +1,444 @@
+#ifndef TRACERGEN_SCENE_FILE_H
+#define TRACERGEN_SCENE_FILE_H
+
+#include "scenes.h"
+#include "mesh_loader.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Scene description files. One statement per line, words separated by blanks, '#' starts
+// a comment. <v> is three numbers. Where a <texture> is expected, either three numbers (a
+// solid color) or the name of a texture defined earlier can be given. Relative texture
+// and mesh paths are resolved against the directory of the scene file.
+//
+//   output <file.png>                  default: the scene file name with a .png extension
+//   resolution <width> <height>
+//   samples <samples_per_pixel> [adaptive <min_samples> <threshold>]
+//   depth <max_depth> <rr_depth>
+//   background <v>
+//   camera <lookfrom v> <lookat v> <vfov> [aperture <a>] [focus <distance>] [vup <v>]
+//   shutter <time0> <time1>
+//   builtin <name>                     a scene of scenes.h with its camera; before any object
+//
+//   texture <name> solid <v>
+//   texture <name> checker <texture> <texture>
+//   texture <name> noise <scale>
+//   texture <name> image <file>
+//
+//   material <name> lambertian <texture>
+//   material <name> metal <v> <fuzz>
+//   material <name> dielectric <index_of_refraction>
+//   material <name> light <texture>
+//   material <name> isotropic <texture>
+//
+//   sphere <center v> <radius> <material>
+//   moving_sphere <center0 v> <center1 v> <time0> <time1> <radius> <material>
+//   xy_rect <x0> <x1> <y0> <y1> <z> <material>     (xz_rect and yz_rect likewise)
+//   box <min v> <max v> <material>
+//   cylinder <base v> <cap v> <radius> <material>
+//   tetrahedron <base_center v> <height> <base_side> <material>
+//   mesh <file.obj|file.ply|file.tgm> <material>
+//   menger_sponge <center v> <side> <iterations> <material>
+//   fractal_tree <root v> <length> <radius> <iterations> <material>
+//   fern <points> <scale> <material>
+//   sierpinski <center v> <side> <depth> <material>
+//
+// Counts are capped: resolution 16384, samples 65536, depth 1000, menger_sponge
+// iterations 8, fractal_tree iterations 7, fern points 10,000,000, sierpinski depth 10.
+//
+// An object can be followed by modifiers, applied left to right:
+//   rotate_y <degrees>   scale <factor>   translate <v>   medium <density> <texture>
+
+// Cursor over the words of one statement. The first problem is remembered and later reads
+// return zero values, so a statement reads all of its arguments and is checked once.
+class scene_words {
+public:
+    explicit scene_words(std::vector<std::string> statement) : words(std::move(statement)) {}
+
+    bool ok() const { return error.empty(); }
+
+    bool at_end() const { return next >= words.size(); }
+
+    void fail(const std::string &message) {
+        if (error.empty())
+            error = message;
+    }
+
+    // Consumes the next word if it is keyword.
+    bool accept(const char *keyword) {
+        if (at_end() || words[next] != keyword)
+            return false;
+        next++;
+        return true;
+    }
+
+    bool next_is_number() const {
+        if (at_end())
+            return false;
+        char *end;
+        std::strtod(words[next].c_str(), &end);
+        return *end == '\0' && end != words[next].c_str();
+    }
+
+    std::string word(const char *what) {
+        if (at_end()) {
+            fail(std::string("missing ") + what);
+            return "";
+        }
+        return words[next++];
+    }
+
+    double number(const char *what) {
+        auto w = word(what);
+        char *end;
+        double value = std::strtod(w.c_str(), &end);
+        if (ok() && (*end != '\0' || end == w.c_str()))
+            fail(std::string("expected a number for ") + what + ", got '" + w + "'");
+        return ok() ? value : 0.0;
+    }
+
+    double positive(const char *what) {
+        double value = number(what);
+        if (ok() && !(value > 0))
+            fail(std::string(what) + " must be positive");
+        return value;
+    }
+
+    // Every count has an upper bound, so a typo cannot ask for days of work or all memory.
+    int integer(const char *what, int min_value, int max_value) {
+        auto w = word(what);
+        char *end;
+        long value = std::strtol(w.c_str(), &end, 10);
+        if (ok() && (*end != '\0' || end == w.c_str()))
+            fail(std::string("expected an integer for ") + what + ", got '" + w + "'");
+        else if (ok() && (value < min_value || value > max_value))
+            fail(std::string(what) + " must be between " + std::to_string(min_value) + " and "
+                 + std::to_string(max_value) + ", got " + w);
+        return ok() ? static_cast<int>(value) : 0;
+    }
+
+    vec3 triple(const char *what) {
+        auto x = number(what);
+        auto y = number(what);
+        auto z = number(what);
+        return vec3(x, y, z);
+    }
+
+public:
+    std::vector<std::string> words;
+    size_t next = 1;
+    std::string error;
+};
+
+class scene_file_parser {
+public:
+    scene_file_parser(const std::string &scene_path, scene_config &scene_config)
+            : path(scene_path), config(scene_config) {
+        auto slash = path.find_last_of('/');
+        directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    bool parse();
+
+private:
+    void statement(scene_words &s);
+    void object(scene_words &s, const std::string &kind);
+    shared_ptr<texture> texture_argument(scene_words &s, const char *what);
+    shared_ptr<material> material_argument(scene_words &s);
+
+    std::string resolve(const std::string &file) const {
+        return file.empty() || file[0] == '/' ? file : directory + file;
+    }
+
+    std::string path;
+    std::string directory;
+    scene_config &config;
+    std::map<std::string, shared_ptr<texture>> textures;
+    std::map<std::string, shared_ptr<material>> materials;
+    bool has_camera = false;
+    bool has_output = false;
+};
+
+inline bool scene_file_parser::parse() {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "ERROR: Could not open scene file '" << path << "'.\n";
+        return false;
+    }
+
+    std::string line;
+    for (int line_number = 1; std::getline(in, line); line_number++) {
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream line_words(line);
+        std::vector<std::string> words;
+        for (std::string w; line_words >> w; )
+            words.push_back(w);
+        if (words.empty())
+            continue;
+
+        scene_words s(std::move(words));
+        statement(s);
+        if (s.ok() && !s.at_end())
+            s.fail("unexpected '" + s.words[s.next] + "'");
+        if (!s.ok()) {
+            std::cerr << "ERROR: " << path << ":" << line_number << ": " << s.error << ".\n";
+            return false;
+        }
+    }
+
+    if (!has_camera) {
+        std::cerr << "ERROR: " << path << ": no camera statement.\n";
+        return false;
+    }
+    if (config.world.objects.empty()) {
+        std::cerr << "ERROR: " << path << ": the scene has no objects.\n";
+        return false;
+    }
+    if (!has_output) {
+        auto dot = path.find_last_of('.');
+        auto slash = path.find_last_of('/');
+        bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+        config.output = (has_extension ? path.substr(0, dot) : path) + ".png";
+    }
+    return true;
+}
+
+inline void scene_file_parser::statement(scene_words &s) {
+    const std::string &keyword = s.words[0];
+    auto &settings = config.settings;
+
+    if (keyword == "output") {
+        config.output = s.word("output file");
+        has_output = true;
+    } else if (keyword == "resolution") {
+        settings.image_width = s.integer("width", 2, 16384);
+        settings.image_height = s.integer("height", 2, 16384);
+    } else if (keyword == "samples") {
+        settings.samples_per_pixel = s.integer("samples per pixel", 1, 65536);
+        if (s.accept("adaptive")) {
+            settings.adaptive_min_samples = s.integer("adaptive minimum samples", 1, 65536);
+            settings.adaptive_threshold = s.number("adaptive threshold");
+            if (s.ok() && settings.adaptive_threshold < 0)
+                s.fail("adaptive threshold must not be negative");
+        }
+    } else if (keyword == "depth") {
+        settings.max_depth = s.integer("maximum depth", 1, 1000);
+        settings.rr_depth = s.integer("russian roulette depth", 1, 1000);
+    } else if (keyword == "background") {
+        settings.background = s.triple("background color");
+    } else if (keyword == "camera") {
+        config.lookfrom = s.triple("camera position");
+        config.lookat = s.triple("camera target");
+        config.vfov = s.positive("vertical field of view");
+        while (s.ok() && !s.at_end()) {
+            if (s.accept("aperture"))
+                config.aperture = s.number("aperture");
+            else if (s.accept("focus"))
+                config.dist_to_focus = s.positive("focus distance");
+            else if (s.accept("vup"))
+                config.vup = s.triple("up vector");
+            else
+                s.fail("unknown camera option '" + s.word("camera option") + "'");
+        }
+        if (s.ok() && (config.lookfrom - config.lookat).near_zero())
+            s.fail("the camera position and target coincide");
+        has_camera = true;
+    } else if (keyword == "shutter") {
+        config.time0 = s.number("shutter open time");
+        config.time1 = s.number("shutter close time");
+    } else if (keyword == "builtin") {
+        auto name = s.word("scene name");
+        if (!config.world.objects.empty())
+            s.fail("builtin must come before any object");
+        else if (s.ok() && !builtin_scene(name, config))
+            s.fail("unknown builtin scene '" + name + "'");
+        has_camera = true;
+    } else if (keyword == "texture") {
+        auto name = s.word("texture name");
+        auto kind = s.word("texture kind");
+        shared_ptr<texture> tex;
+        if (kind == "solid") {
+            tex = make_shared<solid_color>(s.triple("color"));
+        } else if (kind == "checker") {
+            auto even = texture_argument(s, "even checker texture");
+            auto odd = texture_argument(s, "odd checker texture");
+            tex = make_shared<checker_texture>(even, odd);
+        } else if (kind == "noise") {
+            tex = make_shared<noise_texture>(s.positive("noise scale"));
+        } else if (kind == "image") {
+            auto file = resolve(s.word("image file"));
+            if (s.ok())
+                tex = make_shared<image_texture>(file.c_str());
+        } else if (s.ok()) {
+            s.fail("unknown texture kind '" + kind + "'");
+        }
+        if (s.ok() && !textures.emplace(name, tex).second)
+            s.fail("texture '" + name + "' is already defined");
+    } else if (keyword == "material") {
+        auto name = s.word("material name");
+        auto kind = s.word("material kind");
+        shared_ptr<material> mat;
+        if (kind == "lambertian") {
+            mat = make_shared<lambertian>(texture_argument(s, "albedo"));
+        } else if (kind == "metal") {
+            auto albedo = s.triple("albedo");
+            mat = make_shared<metal>(albedo, s.number("fuzz"));
+        } else if (kind == "dielectric") {
+            mat = make_shared<dielectric>(s.positive("index of refraction"));
+        } else if (kind == "light") {
+            mat = make_shared<diffuse_light>(texture_argument(s, "emission"));
+        } else if (kind == "isotropic") {
+            mat = make_shared<isotropic>(texture_argument(s, "albedo"));
+        } else if (s.ok()) {
+            s.fail("unknown material kind '" + kind + "'");
+        }
+        if (s.ok() && !materials.emplace(name, mat).second)
+            s.fail("material '" + name + "' is already defined");
+    } else {
+        object(s, keyword);
+    }
+}
+
+inline void scene_file_parser::object(scene_words &s, const std::string &kind) {
+    shared_ptr<hittable> obj;
+
+    if (kind == "sphere") {
+        auto center = s.triple("center");
+        auto radius = s.positive("radius");
+        obj = make_shared<sphere>(center, radius, material_argument(s));
+    } else if (kind == "moving_sphere") {
+        auto center0 = s.triple("first center");
+        auto center1 = s.triple("second center");
+        auto time0 = s.number("first time");
+        auto time1 = s.number("second time");
+        auto radius = s.positive("radius");
+        obj = make_shared<moving_sphere>(center0, center1, time0, time1, radius, material_argument(s));
+    } else if (kind == "xy_rect" || kind == "xz_rect" || kind == "yz_rect") {
+        double bounds[4];
+        for (auto &b: bounds)
+            b = s.number("rectangle bound");
+        auto k = s.number("plane offset");
+        auto mat = material_argument(s);
+        if (s.ok() && (bounds[0] >= bounds[1] || bounds[2] >= bounds[3]))
+            s.fail("rectangle bounds must be increasing");
+        if (kind == "xy_rect")
+            obj = make_shared<xy_rect>(bounds[0], bounds[1], bounds[2], bounds[3], k, mat);
+        else if (kind == "xz_rect")
+            obj = make_shared<xz_rect>(bounds[0], bounds[1], bounds[2], bounds[3], k, mat);
+        else
+            obj = make_shared<yz_rect>(bounds[0], bounds[1], bounds[2], bounds[3], k, mat);
+    } else if (kind == "box") {
+        auto p0 = s.triple("minimum corner");
+        auto p1 = s.triple("maximum corner");
+        if (s.ok() && (p0.x() >= p1.x() || p0.y() >= p1.y() || p0.z() >= p1.z()))
+            s.fail("the box minimum must be below its maximum");
+        obj = make_shared<box>(p0, p1, material_argument(s));
+    } else if (kind == "cylinder") {
+        auto base = s.triple("base");
+        auto cap = s.triple("cap");
+        auto radius = s.positive("radius");
+        obj = make_shared<cylinder>(base, cap, radius, material_argument(s));
+    } else if (kind == "tetrahedron") {
+        auto base_center = s.triple("base center");
+        auto height = s.positive("height");
+        auto base_side = s.positive("base side length");
+        obj = make_shared<tetrahedron>(base_center, height, base_side, material_argument(s));
+    } else if (kind == "mesh") {
+        auto file = resolve(s.word("mesh file"));
+        auto mat = material_argument(s);
+        if (s.ok()) {
+            obj = load_triangle_mesh(file, mat);
+            if (!obj)
+                s.fail("could not load mesh '" + file + "'");
+        }
+    } else if (kind == "menger_sponge") {
+        auto center = s.triple("center");
+        auto side = s.positive("side length");
+        auto iterations = s.integer("iterations", 0, 8);
+        obj = make_shared<MengerSponge>(center, side, iterations, material_argument(s));
+    } else if (kind == "fractal_tree") {
+        auto root = s.triple("root");
+        auto length = s.positive("length");
+        auto radius = s.positive("radius");
+        auto iterations = s.integer("iterations", 0, 7);
+        auto mat = material_argument(s);
+        if (s.ok())
+            obj = make_shared<FractalTree3D>(root, length, radius, iterations, mat);
+    } else if (kind == "fern") {
+        auto points = s.integer("point count", 1, 10000000);
+        auto scale = s.positive("scale");
+        auto mat = material_argument(s);
+        if (s.ok())
+            obj = make_shared<BarnsleyFern>(points, scale, mat);
+    } else if (kind == "sierpinski") {
+        auto center = s.triple("center");
+        auto side = s.positive("side length");
+        auto depth = s.integer("depth", 0, 10);
+        auto mat = material_argument(s);
+        if (s.ok())
+            obj = SierpinskiTetrahedron::create(depth, center, side, mat);
+    } else {
+        s.fail("unknown statement '" + kind + "'");
+        return;
+    }
+
+    while (s.ok() && !s.at_end()) {
+        if (s.accept("rotate_y")) {
+            obj = make_shared<rotate_y>(obj, s.number("rotation angle"));
+        } else if (s.accept("scale")) {
+            obj = make_shared<transform_instance>(obj, affine_transform::scaling(s.positive("scale factor")));
+        } else if (s.accept("translate")) {
+            obj = make_shared<translate>(obj, s.triple("offset"));
+        } else if (s.accept("medium")) {
+            auto density = s.positive("density");
+            obj = make_shared<constant_medium>(obj, density, texture_argument(s, "medium albedo"));
+        } else {
+            s.fail("unknown modifier '" + s.word("modifier") + "'");
+        }
+    }
+
+    if (s.ok())
+        config.world.add(obj);
+}
+
+inline shared_ptr<texture> scene_file_parser::texture_argument(scene_words &s, const char *what) {
+    if (s.next_is_number())
+        return make_shared<solid_color>(s.triple(what));
+
+    auto name = s.word(what);
+    auto found = textures.find(name);
+    if (found != textures.end())
+        return found->second;
+    if (s.ok())
+        s.fail("unknown texture '" + name + "'");
+    return make_shared<solid_color>(color(0, 0, 0));
+}
+
+inline shared_ptr<material> scene_file_parser::material_argument(scene_words &s) {
+    auto name = s.word("material");
+    auto found = materials.find(name);
+    if (found != materials.end())
+        return found->second;
+    if (s.ok())
+        s.fail("unknown material '" + name + "'");
+    return make_shared<lambertian>(color(0, 0, 0));
+}
+
+// Reads a scene description file into config. Errors are reported on std::cerr with
+// their line number.
+inline bool load_scene_file(const std::string &path, scene_config &config) {
+    scene_file_parser parser(path, config);
+    // Fixed seed, so fractal_tree and fern statements build the same geometry every run.
+    thread_sampler() = sampler();
+    return parser.parse();
+}
+
+#endif //TRACERGEN_SCENE_FILE_H
@@ -23,8 +23,76 @@
 #include "cylinder.h"
 #include "barnsley_fern.h"
 #include "sierpinski_tetrahedron.h"
+#include "instance.h"
+
+#include <map>
+#include <string>
+
+struct image_settings {
+    int image_height;
+    int image_width;
+    int samples_per_pixel;
+    int max_depth;
+    int rr_depth;
+    color background;
+    // Adaptive sampling: pixels get samples in rounds of adaptive_min_samples until the
+    // standard error of their mean luminance falls under adaptive_threshold times the mean,
+    // or samples_per_pixel is reached. A threshold of 0 samples every pixel fully.
+    int adaptive_min_samples;
+    double adaptive_threshold;
+};
+
+// Everything needed to render one image: the world, the camera and the image settings.
+struct scene_config {
+    hittable_list world;
+    image_settings settings = {2000, 1000, 50, 50, 5, color(0, 0, 0), 16, 0};
+
+    point3 lookfrom = point3(0, 0, 0);
+    point3 lookat = point3(0, 0, -1);
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 40.0;
+    double aperture = 0.0;
+    double dist_to_focus = 10.0;
+    double time0 = 0.0;
+    double time1 = 0.0;
+
+    std::string output = "image.png";
+
+    double aspect_ratio() const {
+        return static_cast<double>(settings.image_width) / settings.image_height;
+    }
+
+    camera make_camera() const {
+        return camera(lookfrom, lookat, vup, vfov, aspect_ratio(), aperture, dist_to_focus, time0, time1);
+    }
+};
+
+inline bool is_light(const shared_ptr<material> &mat) {
+    return dynamic_cast<const diffuse_light *>(mat.get()) != nullptr;
+}
+
+// Collects the top-level emissive rectangles and spheres of a scene, which ray_color then
+// samples directly. Emitters nested in a bvh_node or a transform are still reached by
+// material sampling, just not sampled on purpose.
+hittable_list collect_lights(const hittable_list &world) {
+    hittable_list lights;
+
+    for (const auto &object: world.objects) {
+        if (auto r = std::dynamic_pointer_cast<xy_rect>(object); r && is_light(r->mp))
+            lights.add(object);
+        else if (auto r = std::dynamic_pointer_cast<xz_rect>(object); r && is_light(r->mp))
+            lights.add(object);
+        else if (auto r = std::dynamic_pointer_cast<yz_rect>(object); r && is_light(r->mp))
+            lights.add(object);
+        else if (auto s = std::dynamic_pointer_cast<sphere>(object); s && is_light(s->mat_ptr))
+            lights.add(object);
+    }
+
+    return lights;
+}
 
 hittable_list random_scene() {
+    auto &rng = thread_sampler();
     hittable_list world;
 
     auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
@@ -32,24 +100,24 @@ hittable_list random_scene() {
 
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+            auto choose_mat = random_double(rng);
+            point3 center(a + 0.9 * random_double(rng), 0.2, b + 0.9 * random_double(rng));
 
             if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
                 shared_ptr<material> sphere_material;
 
                 if (choose_mat < 0.8) {
                     // diffuse
-                    auto albedo = color(random_double(), random_double(), random_double()) *
-                                  color(random_double(), random_double(), random_double());
+                    auto albedo = color(random_double(rng), random_double(rng), random_double(rng)) *
+                                  color(random_double(rng), random_double(rng), random_double(rng));
                     sphere_material = make_shared<lambertian>(albedo);
-                    auto center2 = center + vec3(0, random_double(0, .5), 0);
+                    auto center2 = center + vec3(0, random_double(0, .5, rng), 0);
                     world.add(make_shared<moving_sphere>(
                             center, center2, 0.0, 1.0, 0.2, sphere_material));
                 } else if (choose_mat < 0.95) {
                     // metal
-                    auto albedo = color(random_double(), random_double(), random_double());;
-                    auto fuzz = random_double(0.1, 0.7);
+                    auto albedo = color(random_double(rng), random_double(rng), random_double(rng));;
+                    auto fuzz = random_double(0.1, 0.7, rng);
                     sphere_material = make_shared<metal>(albedo, fuzz);
                     world.add(make_shared<sphere>(center, 0.2, sphere_material));
                 } else {
@@ -182,6 +250,7 @@ hittable_list cornell_smoke() {
 }
 
 hittable_list final_scene() {
+    auto &rng = thread_sampler();
     hittable_list boxes1;
     auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
 
@@ -193,7 +262,7 @@ hittable_list final_scene() {
             auto z0 = -1000.0 + j * w;
             auto y0 = 0.0;
             auto x1 = x0 + w;
-            auto y1 = random_double(1, 101);
+            auto y1 = random_double(1, 101, rng);
             auto z1 = z0 + w;
 
             boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
@@ -232,7 +301,7 @@ hittable_list final_scene() {
     auto white = make_shared<lambertian>(color(.73, .73, .73));
     int ns = 1000;
     for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(random(0, 165), 10, white));
+        boxes2.add(make_shared<sphere>(random(0, 165, rng), 10, white));
     }
 
     objects.add(make_shared<translate>(
@@ -290,20 +359,29 @@ hittable_list create_fractal_tree_scene() {
 }
 
 hittable_list create_forest() {
+    auto &rng = thread_sampler();
     hittable_list forest;
     auto tree_material = make_shared<lambertian>(color(0.4, 0.2, 0.1));
 
     int num_trees = 20;
     double spacing = 10.0;
 
+    // The radius is proportional to the length, so every tree is a scaled copy of a unit
+    // tree: one is built per iteration count and the forest only holds instances of it.
+    std::map<int, shared_ptr<hittable>> unit_trees;
+
     for (int i = 0; i < num_trees; ++i) {
         for (int j = 0; j < num_trees; ++j) {
-            double initial_length = random_double(4.0, 6.0);
-            double initial_radius = initial_length / 20.0;
-            int iterations = random_int(2, 4);
+            double initial_length = random_double(4.0, 6.0, rng);
+            int iterations = random_int(2, 4, rng);
+
+            auto &unit_tree = unit_trees[iterations];
+            if (!unit_tree)
+                unit_tree = make_shared<FractalTree3D>(point3(0, 0, 0), 1.0, 1.0 / 20.0, iterations, tree_material);
 
             point3 root(i * spacing, 0, j * spacing);
-            forest.add(make_shared<FractalTree3D>(root, initial_length, initial_radius, iterations, tree_material));
+            forest.add(make_shared<transform_instance>(
+                    unit_tree, affine_transform::translation(root) * affine_transform::scaling(initial_length)));
         }
     }
 
@@ -326,10 +404,113 @@ hittable_list sierpinski() {
     point3 center(0, 0, 0);
     double side_length = 6.0;
 
-    objects = SierpinskiTetrahedron::create(depth, center, side_length, mat);
+    objects.add(SierpinskiTetrahedron::create(depth, center, side_length, mat));
 
     return objects;
 }
 
+// Restarts the construction generator from a seed derived from name, so a procedural
+// scene comes out the same whichever thread builds it and whatever was built before.
+inline void seed_scene(const std::string &name) {
+    uint64_t h = 0;
+    for (unsigned char c : name)
+        h = sampler::mix(h ^ c);
+    thread_sampler() = sampler(h, 0);
+}
+
+// Adds one of the scenes above to config, with the camera and background it was set up
+// for. Returns false for an unknown name.
+bool builtin_scene(const std::string &name, scene_config &config) {
+    color sky(0.70, 0.80, 1.00);
+    auto &settings = config.settings;
+
+    seed_scene(name);
+
+    if (name == "random") {
+        config.world = random_scene();
+        settings.background = sky;
+        config.lookfrom = point3(13, 2, 3);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 20.0;
+        config.aperture = 0.1;
+    } else if (name == "two_spheres") {
+        config.world = two_spheres();
+        settings.background = sky;
+        config.lookfrom = point3(13, 2, 3);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 20.0;
+    } else if (name == "two_perlin_spheres") {
+        config.world = two_perlin_spheres();
+        settings.background = sky;
+        config.lookfrom = point3(13, 2, 3);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 20.0;
+    } else if (name == "moon") {
+        config.world = moon();
+        settings.background = sky;
+        config.lookfrom = point3(13, 2, 3);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 20.0;
+    } else if (name == "simple_light") {
+        config.world = simple_light();
+        settings.background = color(0, 0, 0);
+        config.lookfrom = point3(26, 3, 6);
+        config.lookat = point3(0, 2, 0);
+        config.vfov = 20.0;
+    } else if (name == "cornell_box") {
+        config.world = cornell_box();
+        settings.background = color(0, 0, 0);
+        config.lookfrom = point3(278, 278, -800);
+        config.lookat = point3(278, 278, 0);
+        config.vfov = 40.0;
+    } else if (name == "cornell_smoke") {
+        config.world = cornell_smoke();
+        settings.background = color(0, 0, 0);
+        config.lookfrom = point3(278, 278, -800);
+        config.lookat = point3(278, 278, 0);
+        config.vfov = 40.0;
+    } else if (name == "final_scene") {
+        config.world = final_scene();
+        settings.background = color(0, 0, 0);
+        config.lookfrom = point3(478, 278, -600);
+        config.lookat = point3(278, 278, 0);
+        config.vfov = 40.0;
+    } else if (name == "menger_sponge") {
+        config.world = menger_sponge();
+        settings.background = sky;
+        config.lookfrom = point3(0, 0, 3);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 40.0;
+    } else if (name == "fractal_trees") {
+        config.world = create_fractal_tree_scene();
+        settings.background = sky;
+        config.lookfrom = point3(3, 3, 10);
+        config.lookat = point3(0, 1, 0);
+        config.vfov = 40.0;
+    } else if (name == "forest") {
+        config.world = create_forest();
+        settings.background = sky;
+        config.lookfrom = point3(100, 50, 100);
+        config.lookat = point3(100, 5, 50);
+        config.vfov = 40.0;
+    } else if (name == "fern") {
+        config.world = create_ferne();
+        settings.background = sky;
+        config.lookfrom = point3(0, 100, 150);
+        config.lookat = point3(0, 50, 0);
+        config.vfov = 40.0;
+    } else if (name == "sierpinski") {
+        config.world = sierpinski();
+        settings.background = sky;
+        config.lookfrom = point3(0, 0, 15);
+        config.lookat = point3(0, 0, 0);
+        config.vfov = 20.0;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 
 #endif //TRACERGEN_SCENES_H
@@ -13,14 +13,27 @@ public:
     virtual bool hit(
             const ray &r, double t_min, double t_max, hit_record &rec) const override;
 
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
     virtual bool bounding_box(double time0, double time1, aabb &output_box) const override;
 
+    virtual double pdf_value(const point3 &o, const vec3 &v) const override;
+
+    virtual vec3 random(const point3 &o, sampler &rng) const override;
+
 public:
     point3 center;
     double radius;
     shared_ptr<material> mat_ptr;
 
 private:
+    // Nearest intersection distance within [t_min, t_max].
+    bool find_root(const ray &r, double t_min, double t_max, double &root) const;
+
     static void get_sphere_uv(const point3 &p, double &u, double &v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -37,7 +50,7 @@ private:
     }
 };
 
-bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+bool sphere::find_root(const ray &r, double t_min, double t_max, double &root) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
     auto half_b = dot(oc, r.direction());
@@ -48,21 +61,45 @@ bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) cons
     auto sqrtd = sqrt(discriminant);
 
     // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
+    root = (-half_b - sqrtd) / a;
     if (root < t_min || t_max < root) {
         root = (-half_b + sqrtd) / a;
         if (root < t_min || t_max < root)
             return false;
     }
+    return true;
+}
+
+bool sphere::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!find_hit(r, t_min, t_max, rec))
+        return false;
+    finish_hit(r, rec);
+    return true;
+}
+
+bool sphere::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    TRACERGEN_COUNT(stat_sphere_tests);
+    double root;
+    if (!find_root(r, t_min, t_max, root))
+        return false;
 
     rec.t = root;
+    rec.object = this;
+    return true;
+}
+
+void sphere::finish_hit(const ray &r, hit_record &rec) const {
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
-    return true;
+bool sphere::occluded(const ray &r, double t_min, double t_max) const {
+    TRACERGEN_COUNT(stat_sphere_tests);
+    double root;
+    return find_root(r, t_min, t_max, root);
 }
 
 bool sphere::bounding_box(double time0, double time1, aabb &output_box) const {
@@ -72,4 +109,44 @@ bool sphere::bounding_box(double time0, double time1, aabb &output_box) const {
     return true;
 }
 
+double sphere::pdf_value(const point3 &o, const vec3 &v) const {
+    // From inside or on the surface there is no cone to sample.
+    if ((center - o).length_squared() <= radius * radius)
+        return 0;
+
+    double root;
+    if (!find_root(ray(o, v), 0.001, infinity, root))
+        return 0;
+
+    // Uniform over the cone of directions subtended by the sphere.
+    auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
+    auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+    return 1 / solid_angle;
+}
+
+vec3 sphere::random(const point3 &o, sampler &rng) const {
+    vec3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+        return random_unit_vector(rng);
+
+    auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+
+    auto r1 = rng.next_double();
+    auto r2 = rng.next_double();
+    auto z = 1 + r2 * (cos_theta_max - 1);
+    auto phi = 2 * pi * r1;
+    auto x = cos(phi) * sqrt(1 - z * z);
+    auto y = sin(phi) * sqrt(1 - z * z);
+
+    // Orthonormal basis around the direction to the center.
+    vec3 w = unit_vector(direction);
+    vec3 a = (fabs(w.x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+    vec3 v = unit_vector(cross(w, a));
+    vec3 u = cross(w, v);
+
+    return x * u + y * v + z * w;
+}
+
 #endif //TRACERGEN_SPHERE_H
\ No newline at end of file
@@ -0,0 +1,162 @@
+#ifndef TRACERGEN_STATS_H
+#define TRACERGEN_STATS_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Render statistics. Every thread counts into its own cache-line aligned block, so
+// counting is a plain increment with no sharing; blocks are only summed once the render
+// is over. Building with TRACERGEN_STATS=0 turns every TRACERGEN_COUNT into nothing.
+#ifndef TRACERGEN_STATS
+#define TRACERGEN_STATS 1
+#endif
+
+enum stat_counter {
+    stat_camera_rays,
+    stat_secondary_rays,
+    stat_shadow_rays,
+
+    stat_bvh_nodes_visited,
+    stat_box_tests,
+
+    stat_sphere_tests,
+    stat_moving_sphere_tests,
+    stat_rect_tests,
+    stat_box_primitive_tests,
+    stat_cylinder_tests,
+    stat_triangle_tests,
+    stat_triangle_pack_tests,
+    stat_menger_sponge_tests,
+    stat_medium_tests,
+    stat_instance_tests,
+
+    stat_path_segments,
+    stat_paths_escaped,
+    stat_paths_absorbed,
+    stat_paths_russian_roulette,
+    stat_paths_max_depth,
+
+    stat_counter_count
+};
+
+inline const char *stat_name(int counter) {
+    static const char *names[stat_counter_count] = {
+            "camera_rays", "secondary_rays", "shadow_rays",
+            "bvh_nodes_visited", "box_tests",
+            "sphere_tests", "moving_sphere_tests", "rect_tests", "box_primitive_tests", "cylinder_tests",
+            "triangle_tests", "triangle_pack_tests", "menger_sponge_tests", "medium_tests", "instance_tests",
+            "path_segments", "paths_escaped", "paths_absorbed", "paths_russian_roulette", "paths_max_depth",
+    };
+    return names[counter];
+}
+
+struct alignas(64) render_stats {
+    uint64_t counters[stat_counter_count] = {};
+
+    render_stats &operator+=(const render_stats &other) {
+        for (int i = 0; i < stat_counter_count; i++)
+            counters[i] += other.counters[i];
+        return *this;
+    }
+
+    uint64_t operator[](stat_counter counter) const { return counters[counter]; }
+};
+
+// Owns the per-thread blocks. They outlive their threads, so nothing counted is lost when
+// TBB retires a worker.
+class stats_registry {
+public:
+    static render_stats &local() {
+        thread_local render_stats *block = nullptr;
+        if (!block)
+            block = instance().add_block();
+        return *block;
+    }
+
+    // Call these only while no thread is counting, e.g. between renders.
+    static render_stats total() {
+        auto &registry = instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        render_stats sum;
+        for (const auto &block: registry.blocks)
+            sum += *block;
+        return sum;
+    }
+
+    static void reset() {
+        auto &registry = instance();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        for (auto &block: registry.blocks)
+            *block = render_stats();
+    }
+
+private:
+    static stats_registry &instance() {
+        static stats_registry registry;
+        return registry;
+    }
+
+    render_stats *add_block() {
+        std::lock_guard<std::mutex> lock(mutex);
+        blocks.push_back(std::make_unique<render_stats>());
+        return blocks.back().get();
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<render_stats>> blocks;
+};
+
+#if TRACERGEN_STATS
+#define TRACERGEN_COUNT(counter) (stats_registry::local().counters[counter]++)
+#define TRACERGEN_COUNT_N(counter, n) (stats_registry::local().counters[counter] += (n))
+#else
+#define TRACERGEN_COUNT(counter) ((void)0)
+#define TRACERGEN_COUNT_N(counter, n) ((void)0)
+#endif
+
+inline void print_stats(std::ostream &os, const render_stats &stats, double seconds) {
+    auto paths = stats[stat_camera_rays];
+    auto rays = stats[stat_camera_rays] + stats[stat_secondary_rays] + stats[stat_shadow_rays];
+
+    os << "Rays: " << rays << " (" << stats[stat_camera_rays] << " camera, " << stats[stat_secondary_rays]
+       << " secondary, " << stats[stat_shadow_rays] << " shadow)";
+    if (seconds > 0)
+        os << ", " << static_cast<uint64_t>(rays / seconds / 1000) << "k rays/s";
+    os << "\n";
+    if (rays > 0) {
+        os << "Per ray: " << static_cast<double>(stats[stat_bvh_nodes_visited]) / rays << " BVH nodes, "
+           << static_cast<double>(stats[stat_box_tests]) / rays << " box tests\n";
+    }
+    if (paths > 0) {
+        os << "Average path length: " << static_cast<double>(stats[stat_path_segments]) / paths
+           << " segments; ended by escaping " << stats[stat_paths_escaped] << ", absorption "
+           << stats[stat_paths_absorbed] << ", Russian roulette " << stats[stat_paths_russian_roulette]
+           << ", depth limit " << stats[stat_paths_max_depth] << "\n";
+    }
+    os << "Primitive tests:";
+    for (int i = stat_sphere_tests; i <= stat_instance_tests; i++) {
+        if (stats.counters[i] > 0)
+            os << " " << stat_name(i) << "=" << stats.counters[i];
+    }
+    os << "\n";
+}
+
+// One JSON object per call, on a single line, labelled with the scene it belongs to.
+inline void write_stats_json(std::ostream &os, const std::string &scene, const render_stats &stats, double seconds) {
+    os << "{\"scene\":\"";
+    for (char c: scene) {
+        if (c == '"' || c == '\\')
+            os << '\\';
+        os << c;
+    }
+    os << "\",\"seconds\":" << seconds;
+    for (int i = 0; i < stat_counter_count; i++)
+        os << ",\"" << stat_name(i) << "\":" << stats.counters[i];
+    os << "}\n";
+}
+
+#endif //TRACERGEN_STATS_H
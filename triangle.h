@@ -12,6 +12,37 @@ public:
             : v0(_v0), v1(_v1), v2(_v2), mat_ptr(mat) {}
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        if (!find_hit(r, t_min, t_max, rec))
+            return false;
+        finish_hit(r, rec);
+        return true;
+    }
+
+    virtual bool find_hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        TRACERGEN_COUNT(stat_triangle_tests);
+        double t;
+        if (!intersect(r, t_min, t_max, t))
+            return false;
+        rec.t = t;
+        rec.object = this;
+        return true;
+    }
+
+    virtual void finish_hit(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = cross(v1 - v0, v2 - v0);
+        rec.set_face_normal(r, outward_normal);
+        rec.mat_ptr = mat_ptr.get();
+    }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        TRACERGEN_COUNT(stat_triangle_tests);
+        double t;
+        return intersect(r, t_min, t_max, t);
+    }
+
+    // Moller-Trumbore test; t is the hit distance within [t_min, t_max].
+    bool intersect(const ray& r, double t_min, double t_max, double& t) const {
         vec3 edge1 = v1 - v0;
         vec3 edge2 = v2 - v0;
         vec3 h = cross(r.direction(), edge2);
@@ -31,17 +62,8 @@ public:
         if (v < 0.0 || u + v > 1.0)
             return false;
 
-        double t = f * dot(edge2, q);
-        if (t < t_min || t > t_max)
-            return false;
-
-        rec.t = t;
-        rec.p = r.at(t);
-        vec3 outward_normal = cross(edge1, edge2);
-        rec.set_face_normal(r, outward_normal);
-        rec.mat_ptr = mat_ptr;
-
-        return true;
+        t = f * dot(edge2, q);
+        return t >= t_min && t <= t_max;
     }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
@@ -0,0 +1,318 @@
+#ifndef TRACERGEN_TRIANGLE_MESH_H
+#define TRACERGEN_TRIANGLE_MESH_H
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+// The (at most four) triangles of a BVH leaf, vertices stored structure-of-arrays so one
+// ray is tested against all of them at once. Vertices are stored as floats and widened to
+// double for the test; every triangle sharing a vertex reads the same rounded value, so
+// the watertight test stays watertight.
+struct alignas(16) triangle_pack {
+    static constexpr int lanes = bvh_builder::max_prims_in_leaf;
+
+    float v0[3][lanes]; // [axis][lane]
+    float v1[3][lanes];
+    float v2[3][lanes];
+};
+
+// One double per pack lane. GCC/Clang vector extensions lower this to AVX, two SSE2 or
+// two NEON registers, or scalar code, depending on the target. Pack rows are read in
+// place through lane_row and widened by TRACERGEN_PACK_ROW, so no function passes these
+// types by value.
+typedef double lane_double __attribute__((vector_size(sizeof(double) * triangle_pack::lanes)));
+typedef float lane_row __attribute__((vector_size(sizeof(float) * triangle_pack::lanes), may_alias));
+typedef int64_t lane_mask __attribute__((vector_size(sizeof(int64_t) * triangle_pack::lanes)));
+
+// Ray set up for the watertight test (Woop, Benthin and Wald, 2013): the ray is sheared so
+// that it runs along +z from the origin. The edge functions of a shared edge are then
+// computed from the same two vertices by both triangles and have exactly opposite signs,
+// so rays no longer slip through the edges between triangles.
+struct sheared_ray {
+    int kx, ky, kz;
+    double shear_x, shear_y, shear_z;
+    double org_x, org_y, org_z;
+
+    sheared_ray() {}
+
+    explicit sheared_ray(const ray &r) {
+        const vec3 &dir = r.direction();
+        kz = fabs(dir.x()) > fabs(dir.y()) ? (fabs(dir.x()) > fabs(dir.z()) ? 0 : 2)
+                                           : (fabs(dir.y()) > fabs(dir.z()) ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (dir[kz] < 0)
+            std::swap(kx, ky);
+        shear_x = dir[kx] / dir[kz];
+        shear_y = dir[ky] / dir[kz];
+        shear_z = 1.0 / dir[kz];
+        org_x = r.origin()[kx];
+        org_y = r.origin()[ky];
+        org_z = r.origin()[kz];
+    }
+};
+
+// Closest triangle found so far by triangle_mesh::intersect_pack.
+struct pack_hit {
+    int pack = -1;
+    int lane = 0;
+    double t = 0;
+    double u = 0;
+    double v = 0;
+};
+
+// Triangle mesh with a single material, built from an indexed vertex list. The mesh owns
+// a BVH over its triangles, built in the constructor, and every leaf copies the vertices
+// of its triangles into a triangle_pack. The packs are the only copy kept: the indexed
+// input is dropped once they are built, so a triangle costs its share of a 144-byte pack
+// (36 bytes in a full leaf) instead of a heap object.
+class triangle_mesh : public hittable {
+public:
+    triangle_mesh() {}
+
+    triangle_mesh(std::vector<point3> mesh_vertices, std::vector<int> triangle_indices, shared_ptr<material> mat);
+
+    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        if (!find_hit(r, t_min, t_max, rec))
+            return false;
+        finish_hit(r, rec);
+        return true;
+    }
+
+    // The hit triangle is kept as pack * triangle_pack::lanes + lane, its barycentrics as u, v.
+    virtual bool find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const override;
+
+    virtual void finish_hit(const ray &r, hit_record &rec) const override;
+
+    virtual void hit_packet(ray_packet &packet, uint32_t active, double t_min) const override;
+
+    virtual bool occluded(const ray &r, double t_min, double t_max) const override;
+
+    virtual uint32_t occluded_packet(ray_packet &packet, uint32_t active, double t_min) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb &output_box) const override {
+        output_box = box;
+        return n_triangles > 0;
+    }
+
+    size_t triangle_count() const { return n_triangles; }
+
+    // Tests the first count triangles of a pack; a hit closer than closest lowers it and
+    // is stored in best.
+    bool intersect_pack(int pack_index, int count, const sheared_ray &sr, double t_min, double &closest,
+                        pack_hit &best) const;
+
+    void record_hit(const pack_hit &best, hit_record &rec) const {
+        rec.t = best.t;
+        rec.u = best.u;
+        rec.v = best.v;
+        rec.object = this;
+        rec.primitive = best.pack * triangle_pack::lanes + best.lane;
+    }
+
+public:
+    size_t n_triangles = 0;
+    shared_ptr<material> mat_ptr;
+    bvh_accel accel;
+    std::vector<triangle_pack> packs; // one per leaf; leaves reference their pack, not a range
+    aabb box;
+};
+
+inline triangle_mesh::triangle_mesh(
+        std::vector<point3> vertices, std::vector<int> indices, shared_ptr<material> mat
+) : n_triangles(indices.size() / 3), mat_ptr(mat) {
+    if (n_triangles == 0)
+        return;
+
+    // The packs hold floats; round first so the boxes bound the triangles actually tested.
+    for (auto &vertex: vertices)
+        for (int a = 0; a < 3; a++)
+            vertex[a] = static_cast<float>(vertex[a]);
+
+    std::vector<aabb> triangle_boxes(n_triangles);
+    for (size_t i = 0; i < n_triangles; i++) {
+        const point3 &v0 = vertices[indices[3 * i]];
+        const point3 &v1 = vertices[indices[3 * i + 1]];
+        const point3 &v2 = vertices[indices[3 * i + 2]];
+
+        point3 lo, hi;
+        for (int a = 0; a < 3; a++) {
+            lo[a] = fmin(v0[a], fmin(v1[a], v2[a]));
+            hi[a] = fmax(v0[a], fmax(v1[a], v2[a]));
+            // Axis-aligned triangles would give a flat box, so pad it like the aarects.
+            if (hi[a] - lo[a] < 0.0001) {
+                lo[a] -= 0.0001;
+                hi[a] += 0.0001;
+            }
+        }
+        triangle_boxes[i] = aabb(lo, hi);
+        box = i == 0 ? triangle_boxes[0] : surrounding_box(box, triangle_boxes[i]);
+    }
+
+    std::vector<int> triangle_order;
+    accel.build(triangle_boxes, triangle_order, triangle_pack::lanes);
+
+    // Packs dominate the mesh's memory, so size the vector exactly rather than let it grow.
+    size_t n_leaves = 0;
+    accel.remap_leaves([&](int first, int count) {
+        n_leaves++;
+        return first;
+    });
+    packs.reserve(n_leaves);
+
+    // Unused lanes repeat the first triangle; hit() masks them out by the leaf count.
+    accel.remap_leaves([&](int first, int count) {
+        triangle_pack pack;
+        for (int lane = 0; lane < triangle_pack::lanes; lane++) {
+            int triangle = triangle_order[first + (lane < count ? lane : 0)];
+            for (int a = 0; a < 3; a++) {
+                pack.v0[a][lane] = static_cast<float>(vertices[indices[3 * triangle]][a]);
+                pack.v1[a][lane] = static_cast<float>(vertices[indices[3 * triangle + 1]][a]);
+                pack.v2[a][lane] = static_cast<float>(vertices[indices[3 * triangle + 2]][a]);
+            }
+        }
+        packs.push_back(pack);
+        return static_cast<int>(packs.size() - 1);
+    });
+}
+
+// A float row of a pack, widened to one double per lane.
+#define TRACERGEN_PACK_ROW(row) __builtin_convertvector(reinterpret_cast<const lane_row &>(row), lane_double)
+
+inline bool triangle_mesh::intersect_pack(int pack_index, int count, const sheared_ray &sr, double t_min,
+                                          double &closest, pack_hit &best) const {
+    const triangle_pack &pack = packs[pack_index];
+    TRACERGEN_COUNT(stat_triangle_pack_tests);
+    TRACERGEN_COUNT_N(stat_triangle_tests, count);
+    lane_double a_z = TRACERGEN_PACK_ROW(pack.v0[sr.kz]) - sr.org_z;
+    lane_double b_z = TRACERGEN_PACK_ROW(pack.v1[sr.kz]) - sr.org_z;
+    lane_double c_z = TRACERGEN_PACK_ROW(pack.v2[sr.kz]) - sr.org_z;
+    lane_double a_x = TRACERGEN_PACK_ROW(pack.v0[sr.kx]) - sr.org_x - sr.shear_x * a_z;
+    lane_double a_y = TRACERGEN_PACK_ROW(pack.v0[sr.ky]) - sr.org_y - sr.shear_y * a_z;
+    lane_double b_x = TRACERGEN_PACK_ROW(pack.v1[sr.kx]) - sr.org_x - sr.shear_x * b_z;
+    lane_double b_y = TRACERGEN_PACK_ROW(pack.v1[sr.ky]) - sr.org_y - sr.shear_y * b_z;
+    lane_double c_x = TRACERGEN_PACK_ROW(pack.v2[sr.kx]) - sr.org_x - sr.shear_x * c_z;
+    lane_double c_y = TRACERGEN_PACK_ROW(pack.v2[sr.ky]) - sr.org_y - sr.shear_y * c_z;
+
+    lane_double u = c_x * b_y - c_y * b_x;
+    lane_double v = a_x * c_y - a_y * c_x;
+    lane_double w = b_x * a_y - b_y * a_x;
+
+    // Most leaves are missed; leave before the depth and division in that case.
+    lane_mask inside = ((u >= 0) & (v >= 0) & (w >= 0)) | ((u <= 0) & (v <= 0) & (w <= 0));
+    bool any_inside = false;
+    for (int k = 0; k < count; k++)
+        any_inside |= inside[k] != 0;
+    if (!any_inside)
+        return false;
+
+    lane_double det = u + v + w;
+    lane_double t = sr.shear_z * (u * a_z + v * b_z + w * c_z) / det;
+    lane_mask valid = inside & (det != 0) & (t >= t_min) & (t <= closest);
+
+    bool found = false;
+    for (int k = 0; k < count; k++) {
+        if (valid[k] && t[k] <= closest) {
+            closest = t[k];
+            best.t = t[k];
+            best.pack = pack_index;
+            best.lane = k;
+            best.u = v[k] / det[k];
+            best.v = w[k] / det[k];
+            found = true;
+        }
+    }
+    return found;
+}
+
+#undef TRACERGEN_PACK_ROW
+
+inline void triangle_mesh::finish_hit(const ray &r, hit_record &rec) const {
+    const triangle_pack &pack = packs[rec.primitive / triangle_pack::lanes];
+    int lane = rec.primitive % triangle_pack::lanes;
+    point3 v0(pack.v0[0][lane], pack.v0[1][lane], pack.v0[2][lane]);
+    point3 v1(pack.v1[0][lane], pack.v1[1][lane], pack.v1[2][lane]);
+    point3 v2(pack.v2[0][lane], pack.v2[1][lane], pack.v2[2][lane]);
+
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, unit_vector(cross(v1 - v0, v2 - v0)));
+    rec.mat_ptr = mat_ptr.get();
+}
+
+inline bool triangle_mesh::find_hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    const sheared_ray sr(r);
+    pack_hit best;
+    bool hit_anything = accel.traverse(r, t_min, t_max, [&](int pack_index, int count, double &closest) {
+        return intersect_pack(pack_index, count, sr, t_min, closest, best);
+    });
+
+    if (!hit_anything)
+        return false;
+
+    record_hit(best, rec);
+    return true;
+}
+
+inline void triangle_mesh::hit_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    sheared_ray sr[ray_packet::max_size];
+    pack_hit best[ray_packet::max_size];
+    for (uint32_t m = active; m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        sr[i] = sheared_ray(packet.rays[i]);
+    }
+
+    // Every pack is loaded once for all the rays that reached its leaf.
+    accel.traverse_packet(packet, active, t_min, [&](int pack_index, int count, uint32_t rays) {
+        for (; rays; rays &= rays - 1) {
+            int i = __builtin_ctz(rays);
+            intersect_pack(pack_index, count, sr[i], t_min, packet.t_max[i], best[i]);
+        }
+    });
+
+    for (uint32_t m = active; m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        if (best[i].pack >= 0) {
+            record_hit(best[i], packet.recs[i]);
+            packet.hits |= 1u << i;
+        }
+    }
+}
+
+inline bool triangle_mesh::occluded(const ray &r, double t_min, double t_max) const {
+    const sheared_ray sr(r);
+    pack_hit any;
+    return accel.traverse(r, t_min, t_max, [&](int pack_index, int count, double &closest) {
+        if (!intersect_pack(pack_index, count, sr, t_min, closest, any))
+            return false;
+        closest = -infinity;
+        return true;
+    });
+}
+
+inline uint32_t triangle_mesh::occluded_packet(ray_packet &packet, uint32_t active, double t_min) const {
+    sheared_ray sr[ray_packet::max_size];
+    for (uint32_t m = active; m; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        sr[i] = sheared_ray(packet.rays[i]);
+    }
+
+    uint32_t blocked = 0;
+    accel.traverse_packet(packet, active, t_min, [&](int pack_index, int count, uint32_t rays) {
+        pack_hit any;
+        for (; rays; rays &= rays - 1) {
+            int i = __builtin_ctz(rays);
+            if (intersect_pack(pack_index, count, sr[i], t_min, packet.t_max[i], any)) {
+                blocked |= 1u << i;
+                packet.t_max[i] = -infinity;
+            }
+        }
+    });
+    return blocked;
+}
+
+#endif //TRACERGEN_TRIANGLE_MESH_H
@@ -5,7 +5,9 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
-#include <random>
+
+#include "sampler.h"
+#include "stats.h"
 
 // Usings
 
@@ -24,20 +26,26 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
-inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+// Generator used outside the render loop (scene construction, textures). Each thread
+// owns one, so there is no shared state to race on. The random helpers take their
+// generator explicitly, so render code cannot fall back on this one by accident.
+inline sampler &thread_sampler() {
+    thread_local sampler generator;
+    return generator;
+}
+
+inline double random_double(sampler &rng) {
+    return rng.next_double();
 }
 
-inline double random_double(double min, double max) {
+inline double random_double(double min, double max, sampler &rng) {
     // Returns a vecrand real in [min,max).
-    return min + (max - min) * random_double();
+    return rng.next_double(min, max);
 }
 
-inline int random_int(int min, int max) {
+inline int random_int(int min, int max, sampler &rng) {
     // Returns a vecrand integer in [min,max].
-    return static_cast<int>(random_double(min, max + 1));
+    return static_cast<int>(random_double(min, max + 1, rng));
 }
 
 inline double clamp(double x, double min, double max) {
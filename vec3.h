@@ -119,28 +119,28 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline static vec3 vecrand() {
-    return vec3(random_double(), random_double(), random_double());
+inline static vec3 vecrand(sampler &rng) {
+    return vec3(rng.next_double(), rng.next_double(), rng.next_double());
 }
 
-inline static vec3 random(double min, double max) {
-    return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+inline static vec3 random(double min, double max, sampler &rng) {
+    return vec3(rng.next_double(min, max), rng.next_double(min, max), rng.next_double(min, max));
 }
 
-inline vec3 random_in_unit_sphere() {
+inline vec3 random_in_unit_sphere(sampler &rng) {
     while (true) {
-        auto p = random(-1, 1);
+        auto p = random(-1, 1, rng);
         if (p.length_squared() >= 1) continue;
         return p;
     }
 }
 
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+inline vec3 random_unit_vector(sampler &rng) {
+    return unit_vector(random_in_unit_sphere(rng));
 }
 
-inline vec3 random_in_hemisphere(const vec3 &normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+inline vec3 random_in_hemisphere(const vec3 &normal, sampler &rng) {
+    vec3 in_unit_sphere = random_in_unit_sphere(rng);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -158,9 +158,9 @@ inline vec3 refract(const vec3 &uv, const vec3 &n, double etai_over_etat) {
     return r_out_perp + r_out_parallel;
 }
 
-inline vec3 random_in_unit_disk() {
+inline vec3 random_in_unit_disk(sampler &rng) {
     while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        auto p = vec3(rng.next_double(-1, 1), rng.next_double(-1, 1), 0);
         if (p.length_squared() >= 1) continue;
         return p;
     }